@@ -0,0 +1,30 @@
+// A reusable barrier for a fixed set of threads (std::barrier is C++20), for
+// the parallel searches that step in rounds: delta-stepping Dijkstra and
+// direction-optimizing BFS
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+class Barrier {
+    std::mutex lock;
+    std::condition_variable released;
+    unsigned threads, waiting = 0;
+    size_t generation = 0;
+
+public:
+    explicit Barrier(unsigned n) : threads(n) {}
+
+    void wait() {
+        std::unique_lock<std::mutex> guard(lock);
+        size_t arrived = generation;
+        if (++waiting == threads) {
+            waiting = 0;
+            generation++;
+            released.notify_all();
+        } else {
+            released.wait(guard, [&] { return generation != arrived; });
+        }
+    }
+};
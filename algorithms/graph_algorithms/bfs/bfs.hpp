@@ -0,0 +1,244 @@
+// Breadth-first searches over the string graph and over a CSRGraph, shared by
+// bfs.cpp and path_benchmark.cpp
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "../barrier.hpp"
+#include "../csr_graph.hpp"
+
+
+inline std::vector<std::string> bfs_iterative(const std::unordered_map<std::string, std::vector<std::string>>& graph,
+                                              const std::string& start, const std::string& goal) {
+    if (start == goal) return {start};
+
+    std::queue<std::string> q;
+    std::unordered_map<std::string, std::string> parent;  // doubles as the visited set
+
+    q.push(start);
+    parent[start] = start;
+
+    while (!q.empty()) {
+        std::string node = q.front();
+        q.pop();
+
+        auto it = graph.find(node);
+        if (it != graph.end()) {
+            for (const auto& neighbor : it->second) {
+                if (parent.count(neighbor)) continue;
+                parent[neighbor] = node;
+                if (neighbor == goal) return path_to(parent, goal);
+                q.push(neighbor);
+            }
+        }
+    }
+
+    return {};
+}
+
+
+// The same search over a CSR graph. Node ids index flat visited and parent
+// arrays, the queue holds plain ints, and the path is rebuilt once from the
+// parent links when the goal turns up.
+inline std::vector<int> bfs_iterative(const CSRGraph& graph, int start, int goal) {
+    if (start < 0 || goal < 0) return {};
+    if (start == goal) return {start};
+
+    std::vector<int> parent(graph.size(), -1);
+    std::vector<char> visited(graph.size(), false);
+    std::vector<int> queue = {start};
+    visited[start] = true;
+
+    for (size_t head = 0; head < queue.size(); head++) {
+        int node = queue[head];
+        for (int e = graph.offsets[node]; e < graph.offsets[node + 1]; e++) {
+            int neighbor = graph.targets[e];
+            if (visited[neighbor]) continue;
+            parent[neighbor] = node;
+            if (neighbor == goal) return path_to(parent, goal);
+            visited[neighbor] = true;
+            queue.push_back(neighbor);
+        }
+    }
+
+    return {};
+}
+
+
+inline std::vector<std::vector<std::string>> bfs_level_order(
+    const std::unordered_map<std::string, std::vector<std::string>>& graph, const std::string& start) {
+    std::vector<std::vector<std::string>> levels;
+    std::queue<std::string> q;
+    std::unordered_set<std::string> visited;
+
+    q.push(start);
+    visited.insert(start);
+
+    while (!q.empty()) {
+        int level_size = q.size();
+        std::vector<std::string> level;
+
+        for (int i = 0; i < level_size; i++) {
+            std::string node = q.front();
+            q.pop();
+            level.push_back(node);
+
+            auto it = graph.find(node);
+            if (it != graph.end()) {
+                for (const auto& neighbor : it->second) {
+                    if (!visited.count(neighbor)) {
+                        visited.insert(neighbor);
+                        q.push(neighbor);
+                    }
+                }
+            }
+        }
+        levels.push_back(level);
+    }
+
+    return levels;
+}
+
+
+// Direction-optimizing BFS (Beamer, Asanović and Patterson, 2012)
+//
+// Top-down, every frontier node claims its unvisited neighbors. Once the
+// frontier is large, most of those edges lead to nodes that are already
+// visited, so the search turns bottom-up: every unvisited node scans its
+// in-edges for a parent in the frontier and stops at the first one found.
+// It turns back when the frontier shrinks again. The frontier is a list of
+// ids top-down and a bitmap bottom-up, and each step is split across
+// threads. Levels hold the same nodes as bfs_level_order, but each level is
+// in id order: bottom-up steps find nodes by id, not by discovery.
+
+// incoming is graph.reversed(), or graph itself when every edge has a twin.
+// The threads are started once per search and meet at a barrier after each
+// level, where thread 0 gathers the next frontier and picks its direction.
+inline std::vector<std::vector<int>> bfs_direction_optimizing(const CSRGraph& graph, const CSRGraph& incoming,
+                                                              int start, unsigned threads = 0) {
+    const int alpha = 14, beta = 24;  // the paper's switching thresholds
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    int n = graph.size();
+    if (start < 0 || start >= n) return {};
+    if (n < 4096) threads = 1;  // too small to repay the synchronization
+    auto degree = [&](int v) { return graph.offsets[v + 1] - graph.offsets[v]; };
+    auto bit = [](int v) { return uint64_t(1) << (v & 63); };
+
+    std::vector<std::atomic<uint64_t>> visited((n + 63) / 64);
+    std::vector<uint64_t> in_frontier(visited.size());
+    std::vector<std::vector<int>> found(threads);  // each thread's share of the next level
+    std::vector<std::vector<int>> levels;
+
+    std::vector<int> frontier = {start};
+    visited[start >> 6] |= bit(start);
+    long long unexplored_edges = graph.targets.size() - degree(start);
+    bool bottom_up = false;
+    Barrier barrier(threads);
+
+    auto choose_direction = [&] {
+        long long frontier_edges = 0;
+        for (int v : frontier) frontier_edges += degree(v);
+        size_t previous = levels.empty() ? 0 : levels.back().size();
+        if (!bottom_up && frontier_edges > unexplored_edges / alpha) {
+            bottom_up = true;
+        } else if (bottom_up && frontier.size() < previous && frontier.size() < size_t(n / beta)) {
+            bottom_up = false;
+        }
+        if (bottom_up) {
+            std::fill(in_frontier.begin(), in_frontier.end(), 0);
+            for (int v : frontier) in_frontier[v >> 6] |= bit(v);
+        }
+    };
+
+    // Thread t's contiguous slice of [0, count). Slices start on multiples
+    // of 64 so no two share a bitmap word.
+    auto slice = [&](int count, unsigned t) {
+        int size = ((count + int(threads) - 1) / int(threads) + 63) / 64 * 64;
+        return std::make_pair(std::min(count, int(t) * size), std::min(count, int(t + 1) * size));
+    };
+
+    auto worker = [&](unsigned t) {
+        auto& mine = found[t];
+        while (!frontier.empty()) {
+            mine.clear();
+            if (bottom_up) {
+                // Each thread only touches the visited words of its own slice
+                auto [begin, end] = slice(n, t);
+                for (int v = begin; v < end; v++) {
+                    if (visited[v >> 6].load(std::memory_order_relaxed) & bit(v)) continue;
+                    for (int e = incoming.offsets[v]; e < incoming.offsets[v + 1]; e++) {
+                        int u = incoming.targets[e];
+                        if (in_frontier[u >> 6] & bit(u)) {
+                            visited[v >> 6].fetch_or(bit(v), std::memory_order_relaxed);
+                            mine.push_back(v);
+                            break;
+                        }
+                    }
+                }
+            } else {
+                auto [begin, end] = slice(static_cast<int>(frontier.size()), t);
+                for (int i = begin; i < end; i++) {
+                    int u = frontier[i];
+                    for (int e = graph.offsets[u]; e < graph.offsets[u + 1]; e++) {
+                        int v = graph.targets[e];
+                        if (visited[v >> 6].load(std::memory_order_relaxed) & bit(v)) continue;
+                        if (!(visited[v >> 6].fetch_or(bit(v), std::memory_order_relaxed) & bit(v))) {
+                            mine.push_back(v);
+                        }
+                    }
+                }
+            }
+            barrier.wait();
+
+            if (t == 0) {
+                levels.push_back(std::move(frontier));
+                frontier.clear();
+                for (auto& share : found) frontier.insert(frontier.end(), share.begin(), share.end());
+                if (!bottom_up) std::sort(frontier.begin(), frontier.end());
+                for (int v : frontier) unexplored_edges -= degree(v);
+                choose_direction();
+            }
+            barrier.wait();
+        }
+    };
+
+    choose_direction();
+    std::vector<std::thread> helpers;
+    for (unsigned t = 1; t < threads; t++) helpers.emplace_back(worker, t);
+    worker(0);
+    for (auto& helper : helpers) helper.join();
+
+    return levels;
+}
+
+
+inline std::vector<std::vector<int>> bfs_direction_optimizing(const CSRGraph& graph, int start,
+                                                              unsigned threads = 0) {
+    return bfs_direction_optimizing(graph, graph.reversed(), start, threads);
+}
+
+
+// Levels by name, for the string graph. Not a drop-in for bfs_level_order:
+// each level comes back in CSR id order rather than discovery order.
+inline std::vector<std::vector<std::string>> bfs_direction_optimizing(
+    const std::unordered_map<std::string, std::vector<std::string>>& graph,
+    const std::string& start, unsigned threads = 0) {
+    CSRGraph csr(graph);
+    int id = csr.id(start);
+    if (id < 0) return {{start}};
+
+    std::vector<std::vector<std::string>> levels;
+    for (const auto& level : bfs_direction_optimizing(csr, id, threads)) {
+        levels.push_back(csr.names_of(level));
+    }
+    return levels;
+}
@@ -6,7 +6,7 @@
 #include <vector>
 #include <queue>
 #include <unordered_map>
-#include <unordered_set>
+#include "../../csr_graph.hpp"
 
 using namespace std;
 
@@ -15,28 +15,23 @@ vector<string> bfs(const unordered_map<string, vector<string>>& graph,
                    const string& start, const string& goal) {
     if (start == goal) return {start};
     
-    queue<pair<string, vector<string>>> q;
-    unordered_set<string> visited;
+    queue<string> q;
+    unordered_map<string, string> parent;  // doubles as the visited set
     
-    q.push({start, {start}});
-    visited.insert(start);
+    q.push(start);
+    parent[start] = start;
     
     while (!q.empty()) {
-        auto [node, path] = q.front();
+        string node = q.front();
         q.pop();
         
         auto it = graph.find(node);
         if (it != graph.end()) {
             for (const auto& neighbor : it->second) {
-                if (visited.count(neighbor)) continue;
-                if (neighbor == goal) {
-                    path.push_back(neighbor);
-                    return path;
-                }
-                visited.insert(neighbor);
-                auto new_path = path;
-                new_path.push_back(neighbor);
-                q.push({neighbor, new_path});
+                if (parent.count(neighbor)) continue;
+                parent[neighbor] = node;
+                if (neighbor == goal) return path_to(parent, goal);
+                q.push(neighbor);
             }
         }
     }
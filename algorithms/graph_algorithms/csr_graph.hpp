@@ -0,0 +1,118 @@
+// Compressed Sparse Row graph: every adjacency list packed into flat arrays
+//
+// Node names are mapped to dense ids 0..V-1 once, when the graph is built.
+// The out-edges of node v are targets[offsets[v]] .. targets[offsets[v+1] - 1],
+// with their weights at the same indices for a weighted graph, so a
+// traversal walks contiguous ints instead of hashing a string per edge.
+// Per-node state (visited, distance, parent) becomes a vector indexed by id.
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct CSRGraph {
+    std::vector<std::string> names;            // id -> name
+    std::unordered_map<std::string, int> ids;  // name -> id
+    std::vector<int> offsets{0};               // V + 1 entries
+    std::vector<int> targets;                  // E entries
+    std::vector<int> weights;                  // E entries, empty when unweighted
+
+    CSRGraph() = default;
+
+    explicit CSRGraph(const std::unordered_map<std::string, std::vector<std::string>>& graph) {
+        build(graph, false, [](const std::string& edge) { return std::make_pair(&edge, 0); });
+    }
+
+    explicit CSRGraph(const std::unordered_map<std::string, std::vector<std::pair<std::string, int>>>& graph) {
+        build(graph, true, [](const std::pair<std::string, int>& edge) { return std::make_pair(&edge.first, edge.second); });
+    }
+
+    int size() const { return static_cast<int>(offsets.size()) - 1; }
+
+    // -1 for a name that is not in the graph
+    int id(const std::string& name) const {
+        auto it = ids.find(name);
+        return it == ids.end() ? -1 : it->second;
+    }
+
+    // The same nodes with every edge turned around, for walking in-edges.
+    // Only the arrays are filled; names and ids stay with this graph.
+    CSRGraph reversed() const {
+        CSRGraph r;
+        r.offsets.assign(offsets.size(), 0);
+        for (int target : targets) r.offsets[target + 1]++;
+        for (int v = 0; v < size(); v++) r.offsets[v + 1] += r.offsets[v];
+
+        r.targets.resize(targets.size());
+        r.weights.resize(weights.size());
+        std::vector<int> next(r.offsets.begin(), r.offsets.end() - 1);
+        for (int v = 0; v < size(); v++) {
+            for (int e = offsets[v]; e < offsets[v + 1]; e++) {
+                int slot = next[targets[e]]++;
+                r.targets[slot] = v;
+                if (!weights.empty()) r.weights[slot] = weights[e];
+            }
+        }
+        return r;
+    }
+
+    std::vector<std::string> names_of(const std::vector<int>& path) const {
+        std::vector<std::string> result;
+        result.reserve(path.size());
+        for (int node : path) result.push_back(names[node]);
+        return result;
+    }
+
+private:
+    int intern(const std::string& name) {
+        auto it = ids.find(name);
+        if (it != ids.end()) return it->second;
+        ids.emplace(name, static_cast<int>(names.size()));
+        names.push_back(name);
+        return static_cast<int>(names.size()) - 1;
+    }
+
+    // The keys are numbered first, in the map's iteration order, so a second
+    // walk in that same order appends each node's edges right after the
+    // previous node's. Names that only appear as targets are numbered after
+    // the keys and have no out-edges.
+    template <typename Graph, typename Edge>
+    void build(const Graph& graph, bool weighted, Edge edge) {
+        for (const auto& [node, _] : graph) intern(node);
+
+        size_t edges = 0;
+        for (const auto& [_, out] : graph) edges += out.size();
+        targets.reserve(edges);
+        if (weighted) weights.reserve(edges);
+        offsets.reserve(graph.size() + 1);
+        for (const auto& [_, out] : graph) {
+            for (const auto& e : out) {
+                auto [target, weight] = edge(e);
+                targets.push_back(intern(*target));
+                if (weighted) weights.push_back(weight);
+            }
+            offsets.push_back(static_cast<int>(targets.size()));
+        }
+        offsets.resize(names.size() + 1, static_cast<int>(targets.size()));
+    }
+};
+
+// Follows parent links back from goal to the node whose parent is -1
+inline std::vector<int> path_to(const std::vector<int>& parent, int goal) {
+    std::vector<int> path;
+    for (int node = goal; node != -1; node = parent[node]) path.push_back(node);
+    return std::vector<int>(path.rbegin(), path.rend());
+}
+
+// The same walk over a string graph's parent map, where the start node is
+// its own parent (so any name, "" included, can be a node)
+inline std::vector<std::string> path_to(const std::unordered_map<std::string, std::string>& parent,
+                                        const std::string& goal) {
+    std::vector<std::string> path = {goal};
+    for (const std::string* node = &parent.at(goal); *node != path.back(); node = &parent.at(*node)) {
+        path.push_back(*node);
+    }
+    return std::vector<std::string>(path.rbegin(), path.rend());
+}
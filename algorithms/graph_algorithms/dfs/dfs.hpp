@@ -0,0 +1,125 @@
+// Depth-first searches over the string graph and over a CSRGraph, shared by
+// dfs.cpp and path_benchmark.cpp
+#pragma once
+
+#include <stack>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "../csr_graph.hpp"
+
+
+inline bool dfs_recursive_helper(const std::unordered_map<std::string, std::vector<std::string>>& graph,
+                                 const std::string& node, const std::string& goal,
+                                 std::unordered_set<std::string>& visited,
+                                 std::vector<std::string>& path) {
+    if (node == goal) {
+        path.push_back(node);
+        return true;
+    }
+
+    visited.insert(node);
+    path.push_back(node);
+
+    auto it = graph.find(node);
+    if (it != graph.end()) {
+        for (const auto& neighbor : it->second) {
+            if (!visited.count(neighbor)) {
+                if (dfs_recursive_helper(graph, neighbor, goal, visited, path)) {
+                    return true;
+                }
+            }
+        }
+    }
+
+    path.pop_back();
+    return false;
+}
+
+
+inline std::vector<std::string> dfs_recursive(const std::unordered_map<std::string, std::vector<std::string>>& graph,
+                                              const std::string& start, const std::string& goal) {
+    std::unordered_set<std::string> visited;
+    std::vector<std::string> path;
+    dfs_recursive_helper(graph, start, goal, visited, path);
+    return path;
+}
+
+
+inline std::vector<std::string> dfs_iterative(const std::unordered_map<std::string, std::vector<std::string>>& graph,
+                                              const std::string& start, const std::string& goal) {
+    std::stack<std::pair<std::string, std::string>> st;   // node, the node it was pushed from
+    std::unordered_map<std::string, std::string> parent;  // doubles as the visited set
+
+    st.push({start, start});
+
+    while (!st.empty()) {
+        auto [node, from] = st.top();
+        st.pop();
+
+        if (!parent.emplace(node, from).second) continue;
+        if (node == goal) return path_to(parent, goal);
+
+        auto it = graph.find(node);
+        if (it != graph.end()) {
+            for (auto neighbor = it->second.rbegin(); neighbor != it->second.rend(); ++neighbor) {
+                if (!parent.count(*neighbor)) {
+                    st.push({*neighbor, node});
+                }
+            }
+        }
+    }
+
+    return {};
+}
+
+
+// The same search over a CSR graph, with flat visited and parent arrays
+// indexed by node id
+inline std::vector<int> dfs_iterative(const CSRGraph& graph, int start, int goal) {
+    if (start < 0 || goal < 0) return {};
+
+    std::vector<int> parent(graph.size(), -1);
+    std::vector<char> visited(graph.size(), false);
+    std::vector<std::pair<int, int>> st = {{start, -1}};
+
+    while (!st.empty()) {
+        auto [node, from] = st.back();
+        st.pop_back();
+
+        if (visited[node]) continue;
+        visited[node] = true;
+        parent[node] = from;
+        if (node == goal) return path_to(parent, goal);
+
+        for (int e = graph.offsets[node + 1] - 1; e >= graph.offsets[node]; e--) {
+            int neighbor = graph.targets[e];
+            if (!visited[neighbor]) st.push_back({neighbor, node});
+        }
+    }
+
+    return {};
+}
+
+
+inline std::vector<std::string> dfs_postorder(const std::unordered_map<std::string, std::vector<std::string>>& graph,
+                                              const std::string& start,
+                                              std::unordered_set<std::string>& visited) {
+    if (visited.count(start)) return {};
+
+    visited.insert(start);
+    std::vector<std::string> result;
+
+    auto it = graph.find(start);
+    if (it != graph.end()) {
+        for (const auto& neighbor : it->second) {
+            auto sub_result = dfs_postorder(graph, neighbor, visited);
+            result.insert(result.end(), sub_result.begin(), sub_result.end());
+        }
+    }
+
+    result.push_back(start);
+    return result;
+}
@@ -0,0 +1,463 @@
+// Dijkstra's shortest paths over the string graph and over a CSRGraph, with
+// the priority queues they choose between; shared by dijkstra.cpp and
+// path_benchmark.cpp
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "../barrier.hpp"
+#include "../csr_graph.hpp"
+
+// Priority queues for dijkstra_heap, chosen by its Queue template parameter.
+// Each holds (distance, node id) entries: push(node, key) inserts a node or
+// lowers its key, and pop() removes an entry with the smallest key. Keys are
+// popped in nondecreasing order, which RadixHeap relies on. The queues grow
+// to fit whatever ids they are given; nodes is only a sizing hint.
+
+// std::priority_queue, which cannot lower a key: a shorter distance pushes
+// a second entry and pop() discards the stale ones, so the heap can hold an
+// entry for every edge relaxed
+class LazyHeap {
+    std::priority_queue<std::pair<int, int>, std::vector<std::pair<int, int>>, std::greater<std::pair<int, int>>> heap;
+    std::vector<int> best;  // node -> key of its live entry, -1 once popped
+
+    void drop_stale() {
+        while (!heap.empty() && heap.top().first != best[heap.top().second]) heap.pop();
+    }
+
+public:
+    explicit LazyHeap(int nodes = 0) : best(nodes, -1) {}
+
+    bool empty() {
+        drop_stale();
+        return heap.empty();
+    }
+
+    void push(int node, int key) {
+        if (node >= static_cast<int>(best.size())) best.resize(node + 1, -1);
+        best[node] = key;
+        heap.push({key, node});
+    }
+
+    std::pair<int, int> pop() {
+        drop_stale();
+        auto top = heap.top();
+        heap.pop();
+        best[top.second] = -1;
+        return top;
+    }
+};
+
+
+// A d-ary min-heap that records where each node sits, so a lower key moves
+// the node's one entry up in place. It never holds more than V entries, and
+// with Arity 4 it is half as deep as a binary heap and sifts down through
+// children that share a cache line.
+template <int Arity = 4>
+class IndexedHeap {
+    std::vector<std::pair<int, int>> heap;  // (key, node)
+    std::vector<int> position;              // node -> index in heap, -1 when absent
+
+    void place(size_t i, std::pair<int, int> entry) {
+        heap[i] = entry;
+        position[entry.second] = static_cast<int>(i);
+    }
+
+    void sift_up(size_t i, std::pair<int, int> entry) {
+        while (i > 0 && entry.first < heap[(i - 1) / Arity].first) {
+            place(i, heap[(i - 1) / Arity]);
+            i = (i - 1) / Arity;
+        }
+        place(i, entry);
+    }
+
+    void sift_down(size_t i, std::pair<int, int> entry) {
+        for (;;) {
+            size_t first = i * Arity + 1, best = i;
+            int key = entry.first;
+            for (size_t c = first; c < first + Arity && c < heap.size(); c++) {
+                if (heap[c].first < key) {
+                    best = c;
+                    key = heap[c].first;
+                }
+            }
+            if (best == i) break;
+            place(i, heap[best]);
+            i = best;
+        }
+        place(i, entry);
+    }
+
+public:
+    explicit IndexedHeap(int nodes = 0) : position(nodes, -1) {}
+
+    bool empty() const { return heap.empty(); }
+
+    void push(int node, int key) {
+        if (node >= static_cast<int>(position.size())) position.resize(node + 1, -1);
+        if (position[node] < 0) {
+            heap.emplace_back();
+            sift_up(heap.size() - 1, {key, node});
+        } else {
+            sift_up(position[node], {key, node});
+        }
+    }
+
+    std::pair<int, int> pop() {
+        auto top = heap[0];
+        position[top.second] = -1;
+        auto last = heap.back();
+        heap.pop_back();
+        if (!heap.empty()) sift_down(0, last);
+        return top;
+    }
+};
+
+
+// Radix heap (Ahuja, Mehlhorn, Orlin and Tarjan) for integer keys that are
+// never below the last key popped. Bucket 0 holds keys equal to that last
+// key and bucket b keys whose highest bit differing from it is bit b - 1.
+// pop() empties the lowest nonempty bucket into lower ones around its
+// minimum, so each entry moves at most 32 times. A lower key unlinks the
+// node's entry (swapping in its bucket's last) and files it again.
+class RadixHeap {
+    std::vector<std::pair<int, int>> buckets[33];  // (key, node)
+    std::vector<std::pair<int, int>> slot;         // node -> (bucket, index), bucket -1 when absent
+    unsigned last = 0;
+    size_t count = 0;
+
+    int bucket_of(int key) const {
+        unsigned diff = unsigned(key) ^ last;
+        return diff == 0 ? 0 : 32 - __builtin_clz(diff);
+    }
+
+    void insert(std::pair<int, int> entry) {
+        int b = bucket_of(entry.first);
+        slot[entry.second] = {b, static_cast<int>(buckets[b].size())};
+        buckets[b].push_back(entry);
+    }
+
+    void unlink(int node) {
+        auto [b, i] = slot[node];
+        auto moved = buckets[b].back();
+        buckets[b][i] = moved;
+        slot[moved.second].second = i;
+        buckets[b].pop_back();
+    }
+
+public:
+    explicit RadixHeap(int nodes = 0) : slot(nodes, {-1, 0}) {}
+
+    bool empty() const { return count == 0; }
+
+    void push(int node, int key) {
+        if (node >= static_cast<int>(slot.size())) slot.resize(node + 1, {-1, 0});
+        if (slot[node].first < 0) {
+            count++;
+        } else {
+            unlink(node);
+        }
+        insert({key, node});
+    }
+
+    std::pair<int, int> pop() {
+        if (buckets[0].empty()) {
+            int b = 1;
+            while (buckets[b].empty()) b++;
+            last = unsigned(std::min_element(buckets[b].begin(), buckets[b].end())->first);
+            std::vector<std::pair<int, int>> spill;
+            std::swap(spill, buckets[b]);
+            for (auto entry : spill) insert(entry);
+        }
+        auto top = buckets[0].back();
+        buckets[0].pop_back();
+        slot[top.second].first = -1;
+        count--;
+        return top;
+    }
+};
+
+
+// Dial's bucket queue for integer weights no larger than max_weight. Every
+// key in the queue lies within max_weight of the last key popped, so a ring
+// of max_weight + 1 buckets holds each distance in its own bucket and pop()
+// only ever moves forward around it: O(V + E + D) for a maximum distance D.
+// Entries are unlinked like RadixHeap's when a key is lowered. It needs the
+// largest weight up front, so dijkstra_array builds it rather than
+// dijkstra_heap.
+class BucketQueue {
+    std::vector<std::vector<int>> ring;     // nodes by key modulo ring size
+    std::vector<std::pair<int, int>> slot;  // node -> (bucket, index), bucket -1 when absent
+    int current = 0;              // the last key popped
+    size_t count = 0;
+
+    void unlink(int node) {
+        auto [b, i] = slot[node];
+        int moved = ring[b].back();
+        ring[b][i] = moved;
+        slot[moved].second = i;
+        ring[b].pop_back();
+    }
+
+public:
+    explicit BucketQueue(int max_weight, int nodes = 0) : ring(max_weight + 1), slot(nodes, {-1, 0}) {}
+
+    bool empty() const { return count == 0; }
+
+    void push(int node, int key) {
+        if (node >= static_cast<int>(slot.size())) slot.resize(node + 1, {-1, 0});
+        if (slot[node].first < 0) {
+            count++;
+        } else {
+            unlink(node);
+        }
+        int b = key % static_cast<int>(ring.size());
+        slot[node] = {b, static_cast<int>(ring[b].size())};
+        ring[b].push_back(node);
+    }
+
+    std::pair<int, int> pop() {
+        while (ring[current % ring.size()].empty()) current++;
+        auto& bucket = ring[current % ring.size()];
+        int node = bucket.back();
+        bucket.pop_back();
+        slot[node].first = -1;
+        count--;
+        return {current, node};
+    }
+};
+
+
+// Dijkstra over the string graph with any of the queues above. Nodes are
+// numbered as the search reaches them, so the queue, distances and parent
+// links are arrays indexed by that number, and the indexed queues hold at
+// most one entry per node.
+template <typename Queue>
+std::pair<std::vector<std::string>, int> dijkstra_search(
+    const std::unordered_map<std::string, std::vector<std::pair<std::string, int>>>& graph,
+    const std::string& start, const std::string& goal, Queue& queue) {
+
+    std::unordered_map<std::string, int> ids = {{start, 0}};
+    std::vector<const std::string*> names = {&start};
+    std::vector<int> dist = {0};
+    std::vector<int> parent = {-1};
+
+    queue.push(0, 0);
+
+    while (!queue.empty()) {
+        auto [cost, node] = queue.pop();
+
+        if (*names[node] == goal) {
+            std::vector<std::string> path;
+            for (int v : path_to(parent, node)) path.push_back(*names[v]);
+            return {path, cost};
+        }
+
+        auto it = graph.find(*names[node]);
+        if (it != graph.end()) {
+            for (const auto& [neighbor, weight] : it->second) {
+                auto found = ids.find(neighbor);
+                if (found == ids.end()) {
+                    found = ids.emplace(neighbor, static_cast<int>(names.size())).first;
+                    names.push_back(&found->first);
+                    dist.push_back(std::numeric_limits<int>::max());
+                    parent.push_back(-1);
+                }
+                int next = found->second;
+                if (cost + weight < dist[next]) {
+                    dist[next] = cost + weight;
+                    parent[next] = node;
+                    queue.push(next, dist[next]);
+                }
+            }
+        }
+    }
+
+    return {{}, std::numeric_limits<int>::max()};
+}
+
+
+template <typename Queue = IndexedHeap<>>
+std::pair<std::vector<std::string>, int> dijkstra_heap(
+    const std::unordered_map<std::string, std::vector<std::pair<std::string, int>>>& graph,
+    const std::string& start, const std::string& goal) {
+    Queue queue;
+    return dijkstra_search(graph, start, goal, queue);
+}
+
+
+// The same search over a weighted CSR graph, where node ids are already dense
+template <typename Queue = IndexedHeap<>>
+std::pair<std::vector<int>, int> dijkstra_heap(const CSRGraph& graph, int start, int goal) {
+    if (start < 0 || goal < 0) return {{}, std::numeric_limits<int>::max()};
+
+    std::vector<int> dist(graph.size(), std::numeric_limits<int>::max());
+    std::vector<int> parent(graph.size(), -1);
+    Queue queue(graph.size());
+
+    dist[start] = 0;
+    queue.push(start, 0);
+
+    while (!queue.empty()) {
+        auto [cost, node] = queue.pop();
+        if (node == goal) return {path_to(parent, goal), cost};
+
+        for (int e = graph.offsets[node]; e < graph.offsets[node + 1]; e++) {
+            int neighbor = graph.targets[e];
+            int new_cost = cost + graph.weights[e];
+            if (new_cost < dist[neighbor]) {
+                dist[neighbor] = new_cost;
+                parent[neighbor] = node;
+                queue.push(neighbor, new_cost);
+            }
+        }
+    }
+
+    return {{}, std::numeric_limits<int>::max()};
+}
+
+
+// Dial's algorithm: Dijkstra with a ring of buckets indexed by distance in
+// place of a heap. Best for small integer weights; past 65536 the ring
+// would outgrow the graph, so larger weights go to the radix heap instead.
+inline std::pair<std::vector<std::string>, int> dijkstra_array(
+    const std::unordered_map<std::string, std::vector<std::pair<std::string, int>>>& graph,
+    const std::string& start, const std::string& goal) {
+
+    int max_weight = 0;
+    for (const auto& [_, edges] : graph) {
+        for (const auto& edge : edges) max_weight = std::max(max_weight, edge.second);
+    }
+    if (max_weight > 65536) return dijkstra_heap<RadixHeap>(graph, start, goal);
+
+    BucketQueue queue(max_weight);
+    return dijkstra_search(graph, start, goal, queue);
+}
+
+
+// Delta-stepping (Meyer and Sanders, 2003): a parallel Dijkstra that settles
+// a whole bucket of distances [k·delta, (k+1)·delta) per round instead of
+// one node per pop. Threads relax their slice of the bucket's nodes at
+// once; distances can still fall within the round, so improved nodes that
+// land back in the current bucket make another round of it. As in the GAP
+// benchmark suite, light and heavy edges are relaxed together.
+//
+// Each node's distance and parent share one 64-bit word, updated by
+// compare-and-swap, so the parent always belongs to the winning distance.
+// Every thread files improved nodes into its own buckets, and between
+// rounds the threads agree on the lowest nonempty bucket and gather it into
+// the shared frontier. Once that bucket starts above the goal's distance
+// the goal is settled and the search stops.
+//
+// delta = 0 uses the average edge weight: a smaller delta does less wasted
+// relaxation but runs more rounds, a larger one exposes more parallelism.
+inline std::pair<std::vector<int>, int> dijkstra_delta_stepping(const CSRGraph& graph, int start, int goal,
+                                               int delta = 0, unsigned threads = 0) {
+    const int unreached = std::numeric_limits<int>::max();
+    if (start < 0 || goal < 0) return {{}, unreached};
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    if (delta <= 0) {
+        long long total = 0;
+        for (int w : graph.weights) total += w;
+        delta = std::max(1LL, total / std::max<long long>(1, graph.weights.size()));
+    }
+
+    auto pack = [](int dist, int parent) { return uint64_t(uint32_t(dist)) << 32 | uint32_t(parent); };
+    auto dist_of = [](uint64_t state) { return int(state >> 32); };
+
+    std::vector<std::atomic<uint64_t>> state(graph.size());
+    for (auto& s : state) s.store(pack(unreached, -1), std::memory_order_relaxed);
+    state[start].store(pack(0, -1), std::memory_order_relaxed);
+
+    std::vector<std::vector<std::vector<int>>> buckets(threads);  // thread -> bucket -> nodes
+    std::vector<int> frontier = {start};
+    std::vector<size_t> offsets(threads + 1);
+    std::atomic<size_t> next_bucket(std::numeric_limits<size_t>::max());
+    size_t bucket = 0;
+    bool done = false;
+    Barrier barrier(threads);
+
+    auto worker = [&](unsigned t) {
+        auto& mine = buckets[t];
+        while (!done) {
+            size_t begin = frontier.size() * t / threads, end = frontier.size() * (t + 1) / threads;
+            for (size_t i = begin; i < end; i++) {
+                int u = frontier[i];
+                int du = dist_of(state[u].load(std::memory_order_relaxed));
+                if (size_t(du / delta) < bucket) continue;  // settled in an earlier bucket
+                for (int e = graph.offsets[u]; e < graph.offsets[u + 1]; e++) {
+                    int v = graph.targets[e], dv = du + graph.weights[e];
+                    uint64_t old = state[v].load(std::memory_order_relaxed);
+                    while (dv < dist_of(old)) {
+                        if (state[v].compare_exchange_weak(old, pack(dv, u), std::memory_order_relaxed)) {
+                            size_t b = dv / delta;
+                            if (b >= mine.size()) mine.resize(b + 1);
+                            mine[b].push_back(v);
+                            break;
+                        }
+                    }
+                }
+            }
+
+            size_t lowest = bucket;
+            while (lowest < mine.size() && mine[lowest].empty()) lowest++;
+            if (lowest < mine.size()) {
+                size_t seen = next_bucket.load(std::memory_order_relaxed);
+                while (lowest < seen && !next_bucket.compare_exchange_weak(seen, lowest)) {}
+            }
+            barrier.wait();
+
+            if (t == 0) {
+                bucket = next_bucket.exchange(std::numeric_limits<size_t>::max());
+                int goal_dist = dist_of(state[goal].load(std::memory_order_relaxed));
+                done = bucket == std::numeric_limits<size_t>::max() || size_t(goal_dist / delta) < bucket;
+                if (!done) {
+                    for (unsigned k = 0; k < threads; k++) {
+                        size_t size = bucket < buckets[k].size() ? buckets[k][bucket].size() : 0;
+                        offsets[k + 1] = offsets[k] + size;
+                    }
+                    frontier.resize(offsets[threads]);
+                }
+            }
+            barrier.wait();
+
+            if (!done && bucket < mine.size()) {
+                std::copy(mine[bucket].begin(), mine[bucket].end(), frontier.begin() + offsets[t]);
+                std::vector<int>().swap(mine[bucket]);
+            }
+            barrier.wait();
+        }
+    };
+
+    std::vector<std::thread> helpers;
+    for (unsigned t = 1; t < threads; t++) helpers.emplace_back(worker, t);
+    worker(0);
+    for (auto& helper : helpers) helper.join();
+
+    int cost = dist_of(state[goal].load());
+    if (cost == unreached) return {{}, unreached};
+    std::vector<int> parent(graph.size());
+    for (int v = 0; v < graph.size(); v++) parent[v] = int(uint32_t(state[v].load()));
+    return {path_to(parent, goal), cost};
+}
+
+
+// The same contract as dijkstra_heap and dijkstra_array; builds the CSR graph
+// first, so reuse a CSRGraph when searching a large graph more than once
+inline std::pair<std::vector<std::string>, int> dijkstra_delta_stepping(
+    const std::unordered_map<std::string, std::vector<std::pair<std::string, int>>>& graph,
+    const std::string& start, const std::string& goal, int delta = 0, unsigned threads = 0) {
+    if (start == goal) return {{start}, 0};  // even when start is not in the graph, as the others do
+
+    CSRGraph csr(graph);
+    auto [path, cost] = dijkstra_delta_stepping(csr, csr.id(start), csr.id(goal), delta, threads);
+    return {csr.names_of(path), cost};
+}
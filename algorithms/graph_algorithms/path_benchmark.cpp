@@ -0,0 +1,193 @@
+// Path reconstruction benchmark: copying a path into every queue entry
+// versus keeping one parent link per node and rebuilding the path at the goal
+//
+// Compile: g++ -std=c++17 -O2 path_benchmark.cpp -o path_benchmark
+// Usage:   ./path_benchmark [grid side]
+//
+// Each search runs corner to corner on a side x side grid, which makes paths
+// long, in a forked child so that its allocation count and peak RSS are
+// its own. The parent-link searches are the ones bfs.cpp, dfs.cpp and
+// dijkstra.cpp ship, from their headers. Linux only (fork, /proc/self/statm).
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <random>
+#include <vector>
+#include <queue>
+#include <stack>
+#include <unordered_map>
+#include <unordered_set>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "bfs/bfs.hpp"
+#include "dfs/dfs.hpp"
+#include "dijkstra/dijkstra.hpp"
+
+using namespace std;
+
+static size_t allocations = 0;
+static size_t allocated_bytes = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    allocated_bytes += size;
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw bad_alloc();
+}
+
+// Kept out of line: once inlined, GCC pairs the free() with the library's
+// operator new and warns about a mismatch
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { free(p); }
+
+
+// Copying paths, as the searches were written before
+
+vector<string> bfs_copying(const unordered_map<string, vector<string>>& graph,
+                           const string& start, const string& goal) {
+    if (start == goal) return {start};
+    queue<pair<string, vector<string>>> q;
+    unordered_set<string> visited;
+    q.push({start, {start}});
+    visited.insert(start);
+    while (!q.empty()) {
+        auto [node, path] = q.front();
+        q.pop();
+        for (const auto& neighbor : graph.at(node)) {
+            if (visited.count(neighbor)) continue;
+            if (neighbor == goal) {
+                path.push_back(neighbor);
+                return path;
+            }
+            visited.insert(neighbor);
+            auto new_path = path;
+            new_path.push_back(neighbor);
+            q.push({neighbor, new_path});
+        }
+    }
+    return {};
+}
+
+vector<string> dfs_copying(const unordered_map<string, vector<string>>& graph,
+                           const string& start, const string& goal) {
+    stack<pair<string, vector<string>>> st;
+    unordered_set<string> visited;
+    st.push({start, {start}});
+    while (!st.empty()) {
+        auto [node, path] = st.top();
+        st.pop();
+        if (visited.count(node)) continue;
+        if (node == goal) return path;
+        visited.insert(node);
+        const auto& out = graph.at(node);
+        for (auto neighbor = out.rbegin(); neighbor != out.rend(); ++neighbor) {
+            if (!visited.count(*neighbor)) {
+                auto new_path = path;
+                new_path.push_back(*neighbor);
+                st.push({*neighbor, new_path});
+            }
+        }
+    }
+    return {};
+}
+
+struct CopyingState {
+    int cost;
+    string node;
+    vector<string> path;
+    bool operator>(const CopyingState& other) const { return cost > other.cost; }
+};
+
+vector<string> dijkstra_copying(const unordered_map<string, vector<pair<string, int>>>& graph,
+                                const string& start, const string& goal) {
+    priority_queue<CopyingState, vector<CopyingState>, greater<CopyingState>> pq;
+    unordered_set<string> visited;
+    pq.push({0, start, {start}});
+    while (!pq.empty()) {
+        CopyingState current = pq.top();
+        pq.pop();
+        if (visited.count(current.node)) continue;
+        if (current.node == goal) return current.path;
+        visited.insert(current.node);
+        for (const auto& [neighbor, weight] : graph.at(current.node)) {
+            if (!visited.count(neighbor)) {
+                auto new_path = current.path;
+                new_path.push_back(neighbor);
+                pq.push({current.cost + weight, neighbor, new_path});
+            }
+        }
+    }
+    return {};
+}
+
+
+long resident_kb() {
+    long pages = 0, resident = 0;
+    if (FILE* f = fopen("/proc/self/statm", "r")) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Runs search in a child process and reports its time, heap traffic and how
+// far its peak RSS rose above what it inherited from the parent
+void measure(const string& name, const function<vector<string>()>& search) {
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        long before = resident_kb();
+        allocations = allocated_bytes = 0;
+        auto t0 = chrono::steady_clock::now();
+        auto path = search();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        size_t count = allocations, bytes = allocated_bytes;
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        printf("%-18s %8.3fs %12zu allocs %10.1f MB allocated %8.1f MB peak RSS   path %zu\n",
+               name.c_str(), seconds, count, bytes / 1048576.0,
+               max(0L, usage.ru_maxrss - before) / 1024.0, path.size());
+        fflush(stdout);
+        _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+}
+
+
+int main(int argc, char* argv[]) {
+    int side = argc > 1 ? atoi(argv[1]) : 300;
+    auto name = [side](int r, int c) { return to_string(r * side + c); };
+
+    unordered_map<string, vector<string>> grid;
+    unordered_map<string, vector<pair<string, int>>> weighted;
+    mt19937 rng(42);
+    for (int r = 0; r < side; r++) {
+        for (int c = 0; c < side; c++) {
+            auto& out = grid[name(r, c)];
+            auto& wout = weighted[name(r, c)];
+            int dr[] = {0, 1, 0, -1}, dc[] = {1, 0, -1, 0};
+            for (int d = 0; d < 4; d++) {
+                int nr = r + dr[d], nc = c + dc[d];
+                if (nr < 0 || nr >= side || nc < 0 || nc >= side) continue;
+                out.push_back(name(nr, nc));
+                wout.push_back({name(nr, nc), 1 + int(rng() % 9)});
+            }
+        }
+    }
+
+    string start = name(0, 0), goal = name(side - 1, side - 1);
+    cout << side << " x " << side << " grid, " << start << " -> " << goal << endl;
+    measure("bfs copying", [&] { return bfs_copying(grid, start, goal); });
+    measure("bfs parents", [&] { return bfs_iterative(grid, start, goal); });
+    measure("dfs copying", [&] { return dfs_copying(grid, start, goal); });
+    measure("dfs parents", [&] { return dfs_iterative(grid, start, goal); });
+    measure("dijkstra copying", [&] { return dijkstra_copying(weighted, start, goal); });
+    measure("dijkstra parents", [&] { return dijkstra_heap(weighted, start, goal).first; });
+
+    return 0;
+}
@@ -33,6 +33,14 @@ cd dijkstra/run
 cd ../..
 echo
 
+echo "━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━"
+echo "  Path Reconstruction (C++: copied paths vs parent links)"
+echo "━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━"
+g++ -std=c++17 -O2 path_benchmark.cpp -o path_benchmark 2>/dev/null
+./path_benchmark
+rm -f path_benchmark
+echo
+
 echo "╔══════════════════════════════════════════════════════╗"
 echo "║  All benchmarks complete!                            ║"
 echo "╚══════════════════════════════════════════════════════╝"
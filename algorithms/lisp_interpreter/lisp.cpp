@@ -2,310 +2,4293 @@
 // Inspired by Peter Norvig's legendary implementation
 
 #include <iostream>
-#include <sstream>
 #include <vector>
-#include <map>
+#include <deque>
+#include <list>
+#include <unordered_map>
 #include <memory>
 #include <functional>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
 #include <algorithm>
+#include <charconv>
+#include <string_view>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory_resource>
+#include <iomanip>
+#include <csignal>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "lisp.hpp"
 
 using namespace std;
 
-// Forward declarations
-class Env;
-class Exp;
+namespace {
+
+// Heap objects
+//
+// Everything that is not a number or an immediate lives in an Obj. Objects
+// created at runtime are threaded onto the collector's list through `next`;
+// objects built by the reader live in the parse arena and are never freed.
+class Obj {
+public:
+    enum Type : uint8_t { Symbol, Pair, Proc, Lambda, Frame, Future, Memo, Big, Vector, Hash, TypeCount };
+    Type type;
+    bool parsed;
+    bool marked;
+    uint32_t owner;  // the task that made it (see claimForWrite)
+    Obj* next;
+
+    Obj(Type t);
+
+    static void* allocate(Type t, size_t size);
+    static void destroy(Obj* o, pmr::memory_resource& from);
+    size_t size() const;
+};
+
+// Memory
+//
+// Heap objects are allocated through pmr resources so the strategy
+// can be swapped at startup. With the pooled strategy, parse trees go into
+// a bump arena that is never freed piecemeal, and runtime values reuse
+// size-class free lists instead of hitting malloc for every list or frame.
+class CountingResource : public pmr::memory_resource {
+public:
+    pmr::memory_resource* upstream = pmr::new_delete_resource();
+    size_t allocations = 0, bytes = 0, live = 0, peak = 0;
+
+private:
+    void* do_allocate(size_t n, size_t align) override {
+        allocations++;
+        bytes += n;
+        live += n;
+        peak = max(peak, live);
+        return upstream->allocate(n, align);
+    }
+
+    void do_deallocate(void* p, size_t n, size_t align) override {
+        live -= n;
+        upstream->deallocate(p, n, align);
+    }
+
+    bool do_is_equal(const pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
+
+// Size-class free lists carved out of arena chunks. Freed blocks are
+// pushed onto the list for their size and handed out again first. Blocks
+// too large or too aligned for a size class (big vectors, frames and
+// bignums) go straight to the upstream resource and are returned to it.
+class PoolResource : public pmr::memory_resource {
+public:
+    static const size_t Granularity = 16, MaxBlock = 512;
+
+    PoolResource(pmr::memory_resource* up) : upstream(up), chunks(up) {}
+
+private:
+    struct FreeBlock { FreeBlock* next; };
+
+    pmr::memory_resource* upstream;
+    pmr::monotonic_buffer_resource chunks;
+    FreeBlock* freeLists[MaxBlock / Granularity] = {};
+
+    static size_t sizeClass(size_t n) { return (n + Granularity - 1) / Granularity - 1; }
+
+    void* do_allocate(size_t n, size_t align) override {
+        if (n > MaxBlock || align > Granularity) return upstream->allocate(n, align);
+        FreeBlock*& head = freeLists[sizeClass(n)];
+        if (!head) return chunks.allocate((sizeClass(n) + 1) * Granularity, Granularity);
+        FreeBlock* block = head;
+        head = block->next;
+        return block;
+    }
+
+    void do_deallocate(void* p, size_t n, size_t align) override {
+        if (n > MaxBlock || align > Granularity) return upstream->deallocate(p, n, align);
+        FreeBlock*& head = freeLists[sizeClass(n)];
+        head = new (p) FreeBlock{head};
+    }
+
+    bool do_is_equal(const pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
+
+enum class AllocStrategy { Malloc, Pooled };
+
+// Allocation state owned by one pool worker thread. Workers never touch
+// the shared resources: each allocates from its own pool and threads the
+// objects onto its own list, which the collector sweeps while no task is
+// running. Blocks may end up on another thread's free list when swept,
+// so every heap lives until exit.
+struct ThreadHeap {
+    PoolResource pool{pmr::new_delete_resource()};
+    CountingResource resource;
+    Obj* objects = nullptr;
+    size_t counts[Obj::TypeCount] = {};
+    size_t unflushed = 0;  // bytes not yet reported to the collector
+};
+
+thread_local ThreadHeap* threadHeap = nullptr;  // null on a runtime's own thread
+thread_local uint32_t currentOwner = 0;          // stamped on every object this thread makes
+
+struct Memory {
+    pmr::monotonic_buffer_resource arena;
+    PoolResource pool{pmr::new_delete_resource()};
+    CountingResource parse, runtime;
+    pmr::memory_resource* current = &runtime;
+    size_t objects[Obj::TypeCount] = {};
+    deque<ThreadHeap> threadHeaps;
+
+    void use(AllocStrategy strategy) {
+        if (strategy == AllocStrategy::Pooled) {
+            parse.upstream = &arena;
+            runtime.upstream = &pool;
+        } else {
+            parse.upstream = runtime.upstream = pmr::new_delete_resource();
+        }
+    }
+
+    // Called on the main thread before the worker that will own it starts
+    ThreadHeap& newThreadHeap() {
+        ThreadHeap& heap = threadHeaps.emplace_back();
+        heap.resource.upstream = runtime.upstream == &pool ? &heap.pool : runtime.upstream;
+        return heap;
+    }
+
+    void report(ostream& out) const {
+        static const char* names[] = {"Symbol", "Pair", "Proc", "Lambda", "Env", "Future", "Memo", "Big", "Vector", "Hash"};
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        size_t workerAllocs = 0, workerBytes = 0;
+        out << "allocations:";
+        for (int t = 0; t < Obj::TypeCount; t++) {
+            size_t n = objects[t];
+            for (auto& heap : threadHeaps) n += heap.counts[t];
+            out << (t ? ", " : " ") << n << " " << names[t];
+        }
+        for (auto& heap : threadHeaps) {
+            workerAllocs += heap.resource.allocations;
+            workerBytes += heap.resource.bytes;
+        }
+        out << "\n"
+            << "parse:   " << parse.allocations << " allocs, " << parse.bytes << " bytes\n"
+            << "runtime: " << runtime.allocations << " allocs, " << runtime.bytes
+            << " bytes, peak live " << runtime.peak << " bytes\n";
+        if (!threadHeaps.empty()) {
+            out << "workers: " << workerAllocs << " allocs, " << workerBytes << " bytes in "
+                << threadHeaps.size() << " threads\n";
+        }
+        out << "peak RSS: " << usage.ru_maxrss << " KB" << endl;
+    }
+};
+
+thread_local Memory* memory = nullptr;  // these pointers are bound per runtime (see Runtimes)
+
+// Allocates parse-tree nodes from the arena while in scope
+struct ParseScope {
+    pmr::memory_resource* saved = memory->current;
+    ParseScope() { memory->current = &memory->parse; }
+    ~ParseScope() { memory->current = saved; }
+};
+
+
+// Values
+//
+// A Value is 8 bytes, NaN-boxed: a double is stored as itself, and every
+// other kind of value hides in the payload of a quiet NaN. Doubles,
+// fixnums (49-bit integers) and immediates such as () never touch the
+// heap; anything else is a tagged pointer to a garbage-collected Obj.
+class Value {
+public:
+    Value() : bits(QNaN | Undefined) {}
+    Value(double n) {
+        if (n != n) n = NAN;
+        memcpy(&bits, &n, sizeof n);
+    }
+    Value(Obj* o) : bits(Sign | QNaN | reinterpret_cast<uint64_t>(o)) {}
+
+    static constexpr int64_t FixnumMax = (1ll << 48) - 1, FixnumMin = -(1ll << 48);
+
+    static Value nil() { return Value(QNaN | Nil, 0); }
+    static Value makeFixnum(int64_t n) { return Value(QNaN | Fixnum | (uint64_t(n) & (Fixnum - 1)), 0); }
+
+    bool isDouble() const { return (bits & QNaN) != QNaN; }
+    bool isFixnum() const { return (bits & (Sign | QNaN | Fixnum)) == (QNaN | Fixnum); }
+    bool isObj() const { return (bits & (Sign | QNaN)) == (Sign | QNaN); }
+    bool isNil() const { return bits == (QNaN | Nil); }
+    bool isUndefined() const { return bits == (QNaN | Undefined); }
+    bool is(Obj::Type t) const { return isObj() && obj()->type == t; }
+
+    // Identity: the same bits, i.e. the same number or the same object
+    bool operator==(const Value& o) const { return bits == o.bits; }
+    bool operator!=(const Value& o) const { return bits != o.bits; }
+    uint64_t raw() const { return bits; }
+    static Value fromRaw(uint64_t raw) { return Value(raw, 0); }
+
+    double number() const {
+        double n;
+        memcpy(&n, &bits, sizeof n);
+        return n;
+    }
+
+    int64_t fixnum() const { return int64_t(bits << 15) >> 15; }  // sign-extends the low 49 bits
+
+    Obj* obj() const { return reinterpret_cast<Obj*>(bits & ~(Sign | QNaN)); }
+    template <typename T> T* as() const { return static_cast<T*>(obj()); }
+
+private:
+    static const uint64_t Sign = 1ull << 63, QNaN = 0x7ffc000000000000ull;
+    static const uint64_t Nil = 1, Undefined = 2, Fixnum = 1ull << 49;
+    uint64_t bits;
+
+    Value(uint64_t raw, int) : bits(raw) {}
+};
+
+// Garbage collector
+//
+// A stop-the-world mark-and-sweep collector. It runs when the live runtime
+// heap outgrows the threshold, which is then reset to `growth` times the
+// bytes that survived. Roots are the registered RootSets (global table, VM
+// stack) plus the C++ locals the tree walker pins with Root guards.
+//
+// Collection only ever happens on the main thread, and never while a
+// parallel task is outstanding, so worker threads need no safepoints:
+// their roots are thread-local and ignored.
+class RootSet;
+
+class Collector {
+public:
+    static constexpr size_t MinThreshold = 1 << 20;
+
+    Obj* objects = nullptr;
+    Obj* permanent = nullptr;  // parsed objects, freed only at exit
+    vector<RootSet*> rootSets;
+    static thread_local vector<Value*> roots;
+    static thread_local vector<vector<Value>*> rootVectors;
+    double growth = 2.0;
+    size_t live = 0, threshold = MinThreshold;
+    atomic<size_t> foreign{0};  // bytes allocated by workers since the last collection
+    atomic<int> busy{0};        // outstanding parallel tasks
+    size_t collections = 0, reclaimedBytes = 0, reclaimedObjects = 0;
+    double totalPause = 0, maxPause = 0;  // milliseconds
+
+    void collect();
+    void release();  // frees every object, when the runtime shuts down
+    void mark(const Value& v);
+    void mark(Obj* o);
+
+    void report(ostream& out) const {
+        out << "gc: " << collections << " collections, " << totalPause << " ms total pause ("
+            << maxPause << " ms max), " << reclaimedObjects << " objects / "
+            << reclaimedBytes << " bytes reclaimed, " << live << " bytes live" << endl;
+    }
+
+private:
+    vector<Obj*> gray;
+
+    void trace(Obj* o);
+    void sweep(Obj*& list, pmr::memory_resource& from);
+};
+
+thread_local vector<Value*> Collector::roots;
+thread_local vector<vector<Value>*> Collector::rootVectors;
+
+thread_local Collector* collector = nullptr;
+
+// Anything that holds Values outside the heap for a long time registers
+// itself as a root set for its own lifetime
+// (only on the main thread; see above)
+class RootSet {
+public:
+    RootSet() : registered(!threadHeap) {
+        if (registered) collector->rootSets.push_back(this);
+    }
+    RootSet(const RootSet&) = delete;
+    virtual ~RootSet() {
+        if (!registered) return;
+        auto& sets = collector->rootSets;
+        sets.erase(find(sets.begin(), sets.end(), this));
+    }
+    virtual void markRoots() = 0;
+
+private:
+    bool registered;
+};
+
+// Pins a C++ local for as long as it is in scope
+class Root {
+public:
+    Root(Value& v) : vector(false) { collector->roots.push_back(&v); }
+    Root(std::vector<Value>& v) : vector(true) { collector->rootVectors.push_back(&v); }
+    ~Root() {
+        if (vector) collector->rootVectors.pop_back();
+        else collector->roots.pop_back();
+    }
+
+private:
+    bool vector;
+};
+
+// Forward declarations
+class Env;
+struct Exp;
+struct Chunk;
+
+// Builtins are plain function pointers that read their arguments from a
+// caller-owned buffer (the VM stack or the tree walker's ArgStack), so a
+// call allocates nothing. Primitives usually called with two operands
+// also provide a Binary entry point for call sites to cache.
+using Builtin = Value (*)(const Value* args, int argc);
+using Binary = Value (*)(Value a, Value b);
+using Callback = function<Value(const Value* args, int argc)>;  // a native function registered by an embedder
+
+struct SymbolObj : Obj {
+    string name;
+    uint32_t id;
+    SymbolObj(string_view s, uint32_t i) : Obj(Symbol), name(s), id(i) {}
+};
+
+// Lists are chains of immutable pairs ending in (), so cdr and cons share
+// structure and run in constant time.
+struct PairObj : Obj {
+    Value car, cdr;
+    PairObj(Value a, Value d) : Obj(Pair), car(a), cdr(d) {}
+};
+
+struct ProcObj : Obj {
+    Builtin fn;
+    Binary binary;
+    bool pure;  // no side effects: calls on constants can be folded
+    const SymbolObj* name = nullptr;  // the global it was first bound to
+    const Callback* callback = nullptr;  // called instead when fn is null
+    ProcObj(Builtin f, Binary b, bool p) : Obj(Proc), fn(f), binary(b), pure(p) {}
+
+    Value call(const Value* args, int argc) const { return fn ? fn(args, argc) : (*callback)(args, argc); }
+};
+
+struct LambdaObj : Obj {
+    int arity, frameSize;
+    const Exp* code;      // the Lambda node it was made from
+    const Exp* body;      // set for lambdas created by the tree walker
+    const Chunk* chunk;   // set for lambdas created by the bytecode VM
+    Env* env;
+
+    LambdaObj(int a, int size, const Exp* x, const Exp* b, const Chunk* c, Env* e)
+        : Obj(Lambda), arity(a), frameSize(size), code(x), body(b), chunk(c), env(e) {}
+};
+
+// A task for the thread pool: the result of applying proc to arg (or to
+// nothing, for a future's thunk) once some thread has run it
+struct FutureObj : Obj {
+    enum State { Pending, Done, Failed };
+    atomic<int> state{Pending};
+    Value proc, arg, result;
+    bool hasArg;
+    string error;
+
+    FutureObj(Value p, const Value* a) : Obj(Future), proc(p), arg(a ? *a : Value()), hasArg(a) {}
+};
+
+// Symbol table
+//
+// Every symbol is interned: each distinct name maps to one permanent
+// SymbolObj with a dense id, so symbols compare by pointer, scopes key on
+// the id, and a name's characters are stored once however often it is read.
+// Native functions running on pool workers may look names up, but only the
+// runtime's own thread allocates new symbols.
+class SymbolTable {
+public:
+    SymbolObj* intern(string_view name) {
+        lock_guard<mutex> guard(lock);
+        auto it = table.find(name);
+        if (it != table.end()) return it->second;
+        if (threadHeap) throw runtime_error("cannot create symbol " + string(name) + " in a parallel task");
+        ParseScope permanent;
+        void* p = Obj::allocate(Obj::Symbol, sizeof(SymbolObj));
+        auto sym = new (p) SymbolObj(name, table.size());
+        table.emplace(sym->name, sym);  // the key views the symbol's own string
+        byId.push_back(sym);
+        return sym;
+    }
+
+    SymbolObj* at(uint32_t id) const { return byId[id]; }
+
+private:
+    mutex lock;
+    unordered_map<string_view, SymbolObj*> table;
+    vector<SymbolObj*> byId;
+};
+
+thread_local SymbolTable* symbols = nullptr;
+
+Value makePair(Value car, Value cdr) {
+    void* p = Obj::allocate(Obj::Pair, sizeof(PairObj));
+    return Value(new (p) PairObj(car, cdr));
+}
+
+// The items must be reachable elsewhere (the reader's arena, the VM stack)
+Value makeList(const Value* first, const Value* last) {
+    Value list = Value::nil();
+    Root root(list);
+    while (last != first) list = makePair(*--last, list);
+    return list;
+}
+
+Value makeProc(Builtin fn, Binary binary = nullptr, bool pure = false) {
+    void* p = Obj::allocate(Obj::Proc, sizeof(ProcObj));
+    return Value(new (p) ProcObj(fn, binary, pure));
+}
+
+Value makeLambda(int arity, int frameSize, const Exp* code, const Exp* body, const Chunk* chunk, Env* env) {
+    void* p = Obj::allocate(Obj::Lambda, sizeof(LambdaObj));
+    return Value(new (p) LambdaObj(arity, frameSize, code, body, chunk, env));
+}
+
+// A procedure wrapped with a bounded LRU cache of its results. Only calls
+// whose arguments are all numbers, symbols or () are cached: those compare
+// by identity, and never move or die while the key holds them.
+struct MemoObj : Obj {
+    static const int MaxKey = 4;
+
+    struct Key {
+        uint64_t bits[MaxKey];
+        int size = 0;
+
+        bool operator==(const Key& o) const {
+            return size == o.size && equal(bits, bits + size, o.bits);
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& k) const {
+            uint64_t h = k.size;
+            for (int i = 0; i < k.size; i++) h = (h ^ k.bits[i]) * 0x100000001b3ull;
+            return h ^ (h >> 29);
+        }
+    };
+
+    using Entries = list<pair<Key, Value>>;  // most recently used first
+
+    Value fn;
+    size_t capacity;
+    Entries entries;
+    unordered_map<Key, Entries::iterator, KeyHash> index;
+    atomic<size_t> hits{0}, misses{0}, evictions{0};
+    mutex lock;  // pmap tasks may share a memoized function
+
+    MemoObj(Value f, size_t cap) : Obj(Memo), fn(f), capacity(cap) {}
+};
+
+Value makeMemo(Value fn, size_t capacity) {
+    void* p = Obj::allocate(Obj::Memo, sizeof(MemoObj));
+    return Value(new (p) MemoObj(fn, capacity));
+}
+
+FutureObj* makeFuture(Value proc, const Value* arg) {
+    void* p = Obj::allocate(Obj::Future, sizeof(FutureObj));
+    return new (p) FutureObj(proc, arg);
+}
+
+// Numbers
+//
+// Integers are exact. Those that fit in 49 bits are fixnums packed into the
+// Value itself, and arithmetic on them is a machine operation plus an
+// overflow check. A result that does not fit is promoted to a BigObj, an
+// immutable sign and magnitude with 32-bit limbs stored inline, and any big
+// result small enough to be a fixnum again is demoted. Doubles only come
+// from inexact input, or from a division that does not come out even.
+struct BigObj : Obj {
+    bool negative;
+    uint32_t length;
+
+    BigObj(bool neg, uint32_t n) : Obj(Big), negative(neg), length(n) {}
+
+    uint32_t* limbs() { return reinterpret_cast<uint32_t*>(this + 1); }
+    const uint32_t* limbs() const { return reinterpret_cast<const uint32_t*>(this + 1); }
+};
+
+string toString(const Value& x);
+
+// A magnitude: least significant limb first, no leading zero limbs
+using Limbs = vector<uint32_t>;
+
+struct Integer {
+    bool negative = false;
+    Limbs mag;
+};
+
+void trim(Limbs& a) {
+    while (!a.empty() && a.back() == 0) a.pop_back();
+}
+
+int compareMag(const Limbs& a, const Limbs& b) {
+    if (a.size() != b.size()) return a.size() < b.size() ? -1 : 1;
+    for (size_t i = a.size(); i-- > 0;) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+Limbs addMag(const Limbs& a, const Limbs& b) {
+    const Limbs& longer = a.size() >= b.size() ? a : b;
+    const Limbs& shorter = a.size() >= b.size() ? b : a;
+    Limbs result(longer.size() + 1);
+    uint64_t carry = 0;
+    for (size_t i = 0; i < longer.size(); i++) {
+        uint64_t sum = carry + longer[i] + (i < shorter.size() ? shorter[i] : 0);
+        result[i] = uint32_t(sum);
+        carry = sum >> 32;
+    }
+    result.back() = uint32_t(carry);
+    trim(result);
+    return result;
+}
+
+// a - b, where a >= b
+Limbs subMag(const Limbs& a, const Limbs& b) {
+    Limbs result(a.size());
+    int64_t borrow = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        int64_t diff = int64_t(a[i]) - borrow - (i < b.size() ? b[i] : 0);
+        borrow = diff < 0;
+        result[i] = uint32_t(diff);
+    }
+    trim(result);
+    return result;
+}
+
+// Adds x << (32 * shift) into an accumulator wide enough to hold the sum
+void addShifted(Limbs& acc, const Limbs& x, size_t shift) {
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < x.size(); i++) {
+        uint64_t sum = carry + acc[i + shift] + x[i];
+        acc[i + shift] = uint32_t(sum);
+        carry = sum >> 32;
+    }
+    for (i += shift; carry; i++) {
+        uint64_t sum = carry + acc[i];
+        acc[i] = uint32_t(sum);
+        carry = sum >> 32;
+    }
+}
+
+// Karatsuba: three half-size products instead of four. Below the threshold
+// the schoolbook loop's lower overhead wins.
+const size_t KaratsubaThreshold = 32;
+
+Limbs mulMag(const Limbs& a, const Limbs& b) {
+    if (a.empty() || b.empty()) return {};
+    if (min(a.size(), b.size()) < KaratsubaThreshold) {
+        Limbs result(a.size() + b.size());
+        for (size_t i = 0; i < a.size(); i++) {
+            uint64_t carry = 0;
+            for (size_t j = 0; j < b.size(); j++) {
+                uint64_t t = uint64_t(a[i]) * b[j] + result[i + j] + carry;
+                result[i + j] = uint32_t(t);
+                carry = t >> 32;
+            }
+            result[i + b.size()] = uint32_t(carry);
+        }
+        trim(result);
+        return result;
+    }
+
+    size_t half = max(a.size(), b.size()) / 2;
+    auto split = [half](const Limbs& x) {
+        size_t cut = min(half, x.size());
+        pair<Limbs, Limbs> parts{Limbs(x.begin(), x.begin() + cut), Limbs(x.begin() + cut, x.end())};
+        trim(parts.first);
+        return parts;
+    };
+    auto [a0, a1] = split(a);
+    auto [b0, b1] = split(b);
+    Limbs low = mulMag(a0, b0), high = mulMag(a1, b1);
+    Limbs middle = subMag(subMag(mulMag(addMag(a0, a1), addMag(b0, b1)), low), high);
+
+    Limbs result(a.size() + b.size() + 1);
+    addShifted(result, low, 0);
+    addShifted(result, middle, half);
+    addShifted(result, high, 2 * half);
+    trim(result);
+    return result;
+}
+
+// Divides a by d in place and returns the remainder
+uint32_t divSmall(Limbs& a, uint32_t d) {
+    uint64_t rem = 0;
+    for (size_t i = a.size(); i-- > 0;) {
+        uint64_t cur = (rem << 32) | a[i];
+        a[i] = uint32_t(cur / d);
+        rem = cur % d;
+    }
+    trim(a);
+    return rem;
+}
+
+// Knuth's algorithm D: returns a / b and leaves a % b in a. b is nonzero.
+Limbs divMod(Limbs& a, const Limbs& b) {
+    if (compareMag(a, b) < 0) return {};
+    if (b.size() == 1) {
+        uint32_t rem = divSmall(a, b[0]);
+        Limbs q = move(a);
+        a = {rem};
+        trim(a);
+        return q;
+    }
+
+    // Normalize so the divisor's top bit is set, which keeps each estimated
+    // quotient digit at most two too large
+    int s = __builtin_clz(b.back());
+    size_t n = b.size(), m = a.size() - n;
+    Limbs v(n), u(a.size() + 1);
+    for (size_t i = n; i-- > 0;) {
+        v[i] = (b[i] << s) | (s && i ? uint64_t(b[i - 1]) >> (32 - s) : 0);
+    }
+    u[a.size()] = s ? uint64_t(a.back()) >> (32 - s) : 0;
+    for (size_t i = a.size(); i-- > 0;) {
+        u[i] = (a[i] << s) | (s && i ? uint64_t(a[i - 1]) >> (32 - s) : 0);
+    }
+
+    Limbs q(m + 1);
+    for (size_t j = m + 1; j-- > 0;) {
+        uint64_t top = (uint64_t(u[j + n]) << 32) | u[j + n - 1];
+        uint64_t qhat = top / v[n - 1], rhat = top % v[n - 1];
+        while (qhat > UINT32_MAX || qhat * v[n - 2] > ((rhat << 32) | u[j + n - 2])) {
+            qhat--;
+            rhat += v[n - 1];
+            if (rhat > UINT32_MAX) break;
+        }
+
+        int64_t borrow = 0;
+        uint64_t carry = 0;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t product = qhat * v[i] + carry;
+            carry = product >> 32;
+            int64_t diff = int64_t(u[i + j]) - borrow - int64_t(product & UINT32_MAX);
+            u[i + j] = uint32_t(diff);
+            borrow = diff < 0;
+        }
+        int64_t diff = int64_t(u[j + n]) - borrow - int64_t(carry);
+        u[j + n] = uint32_t(diff);
+
+        if (diff < 0) {  // qhat was one too large: add the divisor back
+            qhat--;
+            uint64_t sum = 0;
+            for (size_t i = 0; i < n; i++) {
+                sum = (sum >> 32) + u[i + j] + v[i];
+                u[i + j] = uint32_t(sum);
+            }
+            u[j + n] += uint32_t(sum >> 32);
+        }
+        q[j] = uint32_t(qhat);
+    }
+
+    a.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        a[i] = (u[i] >> s) | (s ? uint64_t(u[i + 1]) << (32 - s) : 0);
+    }
+    trim(a);
+    trim(q);
+    return q;
+}
+
+Integer toInteger(int64_t n) {
+    Integer x;
+    x.negative = n < 0;
+    uint64_t m = n < 0 ? 0 - uint64_t(n) : uint64_t(n);
+    for (; m; m >>= 32) x.mag.push_back(uint32_t(m));
+    return x;
+}
+
+Integer toInteger(const Value& v) {
+    if (v.isFixnum()) return toInteger(v.fixnum());
+    auto big = v.as<BigObj>();
+    return {big->negative, Limbs(big->limbs(), big->limbs() + big->length)};
+}
+
+Value makeInteger(Integer x) {
+    trim(x.mag);
+    if (x.mag.size() <= 2) {
+        uint64_t m = x.mag.empty() ? 0 : x.mag[0] | (x.mag.size() > 1 ? uint64_t(x.mag[1]) << 32 : 0);
+        if (m <= uint64_t(Value::FixnumMax) + x.negative) {
+            return Value::makeFixnum(x.negative ? -int64_t(m) : int64_t(m));
+        }
+    }
+    void* p = Obj::allocate(Obj::Big, sizeof(BigObj) + x.mag.size() * sizeof(uint32_t));
+    auto big = new (p) BigObj(x.negative, x.mag.size());
+    copy(x.mag.begin(), x.mag.end(), big->limbs());
+    return Value(big);
+}
+
+Value makeInteger(int64_t n) {
+    if (n >= Value::FixnumMin && n <= Value::FixnumMax) return Value::makeFixnum(n);
+    return makeInteger(toInteger(n));
+}
+
+bool isInteger(const Value& x) {
+    return x.isFixnum() || x.is(Obj::Big);
+}
+
+double num(const Value& x) {
+    if (x.isDouble()) return x.number();
+    if (x.isFixnum()) return x.fixnum();
+    if (!x.is(Obj::Big)) throw runtime_error("not a number: " + toString(x));
+    auto big = x.as<BigObj>();
+    double result = 0;
+    for (uint32_t i = big->length; i-- > 0;) result = result * 4294967296.0 + big->limbs()[i];
+    return big->negative ? -result : result;
+}
+
+Integer addInteger(const Integer& x, const Integer& y) {
+    if (x.negative == y.negative) return {x.negative, addMag(x.mag, y.mag)};
+    if (compareMag(x.mag, y.mag) >= 0) return {x.negative, subMag(x.mag, y.mag)};
+    return {y.negative, subMag(y.mag, x.mag)};
+}
+
+// Truncating division, as in C: the remainder takes the dividend's sign
+void divideInteger(const Value& a, const Value& b, const char* name, Integer& q, Integer& r) {
+    if (!isInteger(a)) throw runtime_error(string(name) + ": not an integer: " + toString(a));
+    if (!isInteger(b)) throw runtime_error(string(name) + ": not an integer: " + toString(b));
+    r = toInteger(a);
+    Integer d = toInteger(b);
+    if (d.mag.empty()) throw runtime_error(string(name) + ": division by zero");
+    q.negative = r.negative != d.negative;
+    q.mag = divMod(r.mag, d.mag);
+}
+
+// Integer operands that are not both fixnums, or a mix with a double
+enum class Arith { Add, Sub, Mul };
+
+Value arith(Arith op, const Value& a, const Value& b) {
+    if (!isInteger(a) || !isInteger(b)) {
+        double x = num(a), y = num(b);
+        return Value(op == Arith::Add ? x + y : op == Arith::Sub ? x - y : x * y);
+    }
+    Integer x = toInteger(a), y = toInteger(b);
+    if (op == Arith::Mul) return makeInteger(Integer{x.negative != y.negative, mulMag(x.mag, y.mag)});
+    if (op == Arith::Sub) y.negative = !y.negative;
+    return makeInteger(addInteger(x, y));
+}
+
+// Fixnum sums and differences fit in an int64_t; only products can overflow
+Value add(Value a, Value b) {
+    if (a.isFixnum() && b.isFixnum()) return makeInteger(a.fixnum() + b.fixnum());
+    if (a.isDouble() && b.isDouble()) return Value(a.number() + b.number());
+    return arith(Arith::Add, a, b);
+}
+
+Value sub(Value a, Value b) {
+    if (a.isFixnum() && b.isFixnum()) return makeInteger(a.fixnum() - b.fixnum());
+    if (a.isDouble() && b.isDouble()) return Value(a.number() - b.number());
+    return arith(Arith::Sub, a, b);
+}
+
+Value mul(Value a, Value b) {
+    int64_t product;
+    if (a.isFixnum() && b.isFixnum() && !__builtin_mul_overflow(a.fixnum(), b.fixnum(), &product)) {
+        return makeInteger(product);
+    }
+    if (a.isDouble() && b.isDouble()) return Value(a.number() * b.number());
+    return arith(Arith::Mul, a, b);
+}
+
+// Exact when the division comes out even, a double otherwise
+Value div(Value a, Value b) {
+    if (a.isFixnum() && b.isFixnum()) {
+        int64_t x = a.fixnum(), y = b.fixnum();
+        if (y == 0) throw runtime_error("/: division by zero");
+        if (x % y == 0) return makeInteger(x / y);
+        return Value(double(x) / y);
+    }
+    if (!isInteger(a) || !isInteger(b)) return Value(num(a) / num(b));
+    Integer q, r;
+    divideInteger(a, b, "/", q, r);
+    if (r.mag.empty()) return makeInteger(move(q));
+    return Value(num(a) / num(b));
+}
+
+Value quotient(Value a, Value b) {
+    if (a.isFixnum() && b.isFixnum() && b.fixnum() != 0) return makeInteger(a.fixnum() / b.fixnum());
+    Integer q, r;
+    divideInteger(a, b, "quotient", q, r);
+    return makeInteger(move(q));
+}
+
+Value remainder(Value a, Value b) {
+    if (a.isFixnum() && b.isFixnum() && b.fixnum() != 0) return Value::makeFixnum(a.fixnum() % b.fixnum());
+    Integer q, r;
+    divideInteger(a, b, "remainder", q, r);
+    return makeInteger(move(r));
+}
+
+// Like remainder, but the result takes the divisor's sign
+Value modulo(Value a, Value b) {
+    if (a.isFixnum() && b.isFixnum() && b.fixnum() != 0) {
+        int64_t r = a.fixnum() % b.fixnum();
+        return Value::makeFixnum(r && (r < 0) != (b.fixnum() < 0) ? r + b.fixnum() : r);
+    }
+    Integer q, r;
+    divideInteger(a, b, "modulo", q, r);
+    bool negativeDivisor = b.isFixnum() ? b.fixnum() < 0 : b.as<BigObj>()->negative;
+    if (!r.mag.empty() && r.negative != negativeDivisor) {
+        return add(makeInteger(move(r)), b);
+    }
+    return makeInteger(move(r));
+}
+
+// -1, 0 or 1; 2 if either side is NaN, so that every comparison is false
+int compare(const Value& a, const Value& b) {
+    if (a.isFixnum() && b.isFixnum()) return (a.fixnum() > b.fixnum()) - (a.fixnum() < b.fixnum());
+    if (!isInteger(a) || !isInteger(b)) {
+        double x = num(a), y = num(b);
+        return x < y ? -1 : x > y ? 1 : x == y ? 0 : 2;
+    }
+    Integer x = toInteger(a), y = toInteger(b);
+    if (x.negative != y.negative) return x.negative ? -1 : 1;
+    int order = compareMag(x.mag, y.mag);
+    return x.negative ? -order : order;
+}
+
+Value lt(Value a, Value b) { return Value::makeFixnum(compare(a, b) == -1); }
+Value gt(Value a, Value b) { return Value::makeFixnum(compare(a, b) == 1); }
+Value eq(Value a, Value b) { return Value::makeFixnum(compare(a, b) == 0); }
+
+// Decimal digits, nine at a time
+Value parseInteger(string_view digits, bool negative) {
+    Integer x{negative, {}};
+    while (!digits.empty()) {
+        size_t n = (digits.size() - 1) % 9 + 1;
+        uint32_t chunk = 0, scale = 1;
+        for (char c : digits.substr(0, n)) {
+            chunk = chunk * 10 + (c - '0');
+            scale *= 10;
+        }
+        digits.remove_prefix(n);
+        Limbs scaled = mulMag(x.mag, Limbs{scale});
+        x.mag = addMag(scaled, Limbs{chunk});
+    }
+    return makeInteger(move(x));
+}
+
+string formatNumber(const Value& x) {
+    if (x.isFixnum()) return to_string(x.fixnum());
+    if (x.isDouble()) {
+        double d = x.number();
+        if (isnan(d)) return "+nan.0";
+        if (isinf(d)) return d > 0 ? "+inf.0" : "-inf.0";
+        char buf[32];
+        auto end = to_chars(buf, buf + sizeof buf, d).ptr;
+        string s(buf, end);
+        if (s.find_first_of(".e") == string::npos) s += ".0";  // keep inexact integers recognizable
+        return s;
+    }
+    Integer big = toInteger(x);
+    vector<uint32_t> chunks;
+    while (!big.mag.empty()) chunks.push_back(divSmall(big.mag, 1000000000));
+    string s = big.negative ? "-" : "";
+    s += to_string(chunks.back());
+    for (size_t i = chunks.size() - 1; i-- > 0;) {
+        string chunk = to_string(chunks[i]);
+        s.append(9 - chunk.size(), '0');
+        s += chunk;
+    }
+    return s;
+}
+
+// Vectors and hash tables
+//
+// A vector is a fixed number of slots stored inline, like an Env frame, so
+// indexing is O(1). A hash table is open addressing with linear probing
+// over one flat array of entries, doubled once it is three quarters full.
+// Keys match when they are the same value: the same number, symbol or
+// object, or bignums with equal digits.
+struct VectorObj : Obj {
+    uint32_t size;
+
+    VectorObj(uint32_t n, Value fill) : Obj(Vector), size(n) {
+        for (uint32_t i = 0; i < n; i++) new (&items()[i]) Value(fill);
+    }
+
+    Value* items() { return reinterpret_cast<Value*>(this + 1); }
+};
+
+Value makeVector(uint32_t size, Value fill) {
+    void* p = Obj::allocate(Obj::Vector, sizeof(VectorObj) + size * sizeof(Value));
+    return Value(new (p) VectorObj(size, fill));
+}
+
+struct HashObj : Obj {
+    struct Entry {
+        Value key, value;  // an undefined key marks an empty slot
+    };
+
+    vector<Entry> entries;
+    size_t count = 0;
+
+    HashObj() : Obj(Hash), entries(8) {}
+
+    static bool same(const Value& a, const Value& b) {
+        if (a == b) return true;
+        if (!a.is(Big) || !b.is(Big)) return false;
+        auto x = a.as<BigObj>(), y = b.as<BigObj>();
+        return x->negative == y->negative && x->length == y->length
+            && equal(x->limbs(), x->limbs() + x->length, y->limbs());
+    }
+
+    static uint64_t hash(const Value& key) {
+        uint64_t h = key.raw();
+        if (key.is(Big)) {
+            auto big = key.as<BigObj>();
+            h = big->negative;
+            for (uint32_t i = 0; i < big->length; i++) h = (h ^ big->limbs()[i]) * 0x100000001b3ull;
+        }
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;  // splitmix64's finalizer
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+        return h ^ (h >> 31);
+    }
+
+    // The entry holding key, or the empty slot where it would go
+    Entry& find(const Value& key) {
+        size_t mask = entries.size() - 1;
+        for (size_t i = hash(key) & mask; ; i = (i + 1) & mask) {
+            Entry& e = entries[i];
+            if (e.key.isUndefined() || same(e.key, key)) return e;
+        }
+    }
+
+    void set(const Value& key, const Value& value) {
+        Entry* e = &find(key);
+        if (e->key.isUndefined()) {
+            if ((count + 1) * 4 > entries.size() * 3) {
+                grow();
+                e = &find(key);
+            }
+            e->key = key;
+            count++;
+        }
+        e->value = value;
+    }
+
+    void grow() {
+        vector<Entry> old(entries.size() * 2);
+        swap(old, entries);
+        for (auto& e : old) {
+            if (!e.key.isUndefined()) find(e.key) = e;
+        }
+    }
+};
+
+Value makeHash() {
+    void* p = Obj::allocate(Obj::Hash, sizeof(HashObj));
+    return Value(new (p) HashObj());
+}
+
+string toString(const Value& x) {
+    if (x.isDouble() || x.isFixnum() || x.is(Obj::Big)) return formatNumber(x);
+    if (x.isNil()) return "()";
+    if (!x.isObj()) return "";
+    switch (x.obj()->type) {
+        case Obj::Symbol: return x.as<SymbolObj>()->name;
+        case Obj::Pair: {
+            string result = "(";
+            Value rest = x;
+            for (; rest.is(Obj::Pair); rest = rest.as<PairObj>()->cdr) {
+                if (rest != x) result += " ";
+                result += toString(rest.as<PairObj>()->car);
+            }
+            if (!rest.isNil()) result += " . " + toString(rest);
+            return result + ")";
+        }
+        case Obj::Proc: return "<procedure>";
+        case Obj::Lambda: return "<lambda>";
+        case Obj::Future: return "<future>";
+        case Obj::Memo: return "<memoized " + toString(x.as<MemoObj>()->fn) + ">";
+        case Obj::Vector: {
+            auto v = x.as<VectorObj>();
+            string result = "#(";
+            for (uint32_t i = 0; i < v->size; i++) {
+                if (i) result += " ";
+                result += toString(v->items()[i]);
+            }
+            return result + ")";
+        }
+        case Obj::Hash: return "<hash-table " + to_string(x.as<HashObj>()->count) + ">";
+        default: return "";
+    }
+}
+
+// Environment
+//
+// A frame is a flat array of slots stored inline after the header.
+// Variables are addressed by (depth, slot) pairs computed ahead of time by
+// the Resolver, so a lookup is a few pointer hops and an index.
+class Env : public Obj {
+public:
+    Env* outer;
+    Value* slots;
+    uint32_t size;
+
+    Env(uint32_t n, Env* o) : Obj(Frame), outer(o), slots(inlineSlots()), size(n) {
+        for (uint32_t i = 0; i < n; i++) new (&slots[i]) Value();
+    }
+
+    static Env* make(uint32_t size, Env* o = nullptr) {
+        void* p = Obj::allocate(Frame, sizeof(Env) + size * sizeof(Value));
+        return new (p) Env(size, o);
+    }
+
+    Value& at(int depth, int slot) {
+        Env* e = this;
+        while (depth-- > 0) e = e->outer;
+        return e->slots[slot];
+    }
+
+private:
+    Value* inlineSlots() { return reinterpret_cast<Value*>(this + 1); }
+};
+
+Obj::Obj(Type t) : type(t), parsed(false), marked(false), owner(currentOwner) {
+    ThreadHeap* heap = threadHeap;
+    if (!heap) parsed = memory->current == &memory->parse;
+    Obj*& list = heap ? heap->objects : parsed ? collector->permanent : collector->objects;
+    next = list;
+    list = this;
+}
+
+size_t Obj::size() const {
+    switch (type) {
+        case Symbol: return sizeof(SymbolObj);
+        case Pair: return sizeof(PairObj);
+        case Proc: return sizeof(ProcObj);
+        case Lambda: return sizeof(LambdaObj);
+        case Frame: return sizeof(Env) + static_cast<const Env*>(this)->size * sizeof(Value);
+        case Future: return sizeof(FutureObj);
+        case Memo: return sizeof(MemoObj);
+        case Big: return sizeof(BigObj) + static_cast<const BigObj*>(this)->length * sizeof(uint32_t);
+        case Vector: return sizeof(VectorObj) + static_cast<const VectorObj*>(this)->size * sizeof(Value);
+        case Hash: return sizeof(HashObj);
+        default: return 0;
+    }
+}
+
+void Obj::destroy(Obj* o, pmr::memory_resource& from) {
+    size_t size = o->size();
+    switch (o->type) {
+        case Symbol: static_cast<SymbolObj*>(o)->~SymbolObj(); break;
+        case Pair: static_cast<PairObj*>(o)->~PairObj(); break;
+        case Proc: static_cast<ProcObj*>(o)->~ProcObj(); break;
+        case Future: static_cast<FutureObj*>(o)->~FutureObj(); break;
+        case Memo: static_cast<MemoObj*>(o)->~MemoObj(); break;
+        case Hash: static_cast<HashObj*>(o)->~HashObj(); break;
+        default: break;
+    }
+    from.deallocate(o, size, alignof(Obj));
+}
+
+void Collector::mark(const Value& v) {
+    if (v.isObj()) mark(v.obj());
+}
+
+// Parsed objects only ever point at other parsed objects, so they are
+// neither marked nor traced.
+void Collector::mark(Obj* o) {
+    if (!o || o->parsed || o->marked) return;
+    o->marked = true;
+    gray.push_back(o);
+}
+
+void Collector::trace(Obj* o) {
+    switch (o->type) {
+        case Obj::Pair:
+            mark(static_cast<PairObj*>(o)->car);
+            mark(static_cast<PairObj*>(o)->cdr);
+            break;
+        case Obj::Lambda:
+            mark(static_cast<LambdaObj*>(o)->env);
+            break;
+        case Obj::Future: {
+            auto future = static_cast<FutureObj*>(o);
+            mark(future->proc);
+            mark(future->arg);
+            mark(future->result);
+            break;
+        }
+        case Obj::Memo: {
+            auto memo = static_cast<MemoObj*>(o);
+            mark(memo->fn);
+            for (auto& entry : memo->entries) mark(entry.second);
+            break;
+        }
+        case Obj::Frame: {
+            auto env = static_cast<Env*>(o);
+            mark(env->outer);
+            for (uint32_t i = 0; i < env->size; i++) mark(env->slots[i]);
+            break;
+        }
+        case Obj::Vector: {
+            auto v = static_cast<VectorObj*>(o);
+            for (uint32_t i = 0; i < v->size; i++) mark(v->items()[i]);
+            break;
+        }
+        case Obj::Hash:
+            for (auto& e : static_cast<HashObj*>(o)->entries) {
+                mark(e.key);
+                mark(e.value);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void Collector::collect() {
+    auto start = chrono::steady_clock::now();
+
+    for (auto set : rootSets) set->markRoots();
+    for (auto v : roots) mark(*v);
+    for (auto vec : rootVectors) {
+        for (auto& v : *vec) mark(v);
+    }
+    while (!gray.empty()) {
+        Obj* o = gray.back();
+        gray.pop_back();
+        trace(o);
+    }
+
+    live = 0;
+    foreign = 0;
+    sweep(objects, memory->runtime);
+    for (auto& heap : memory->threadHeaps) sweep(heap.objects, heap.resource);
+
+    threshold = max(MinThreshold, (size_t)(live * growth));
+    double pause = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    collections++;
+    totalPause += pause;
+    maxPause = max(maxPause, pause);
+}
+
+void Collector::sweep(Obj*& list, pmr::memory_resource& from) {
+    Obj** link = &list;
+    while (Obj* o = *link) {
+        size_t size = o->size();
+        if (o->marked) {
+            o->marked = false;
+            live += size;
+            link = &o->next;
+        } else {
+            *link = o->next;
+            reclaimedBytes += size;
+            reclaimedObjects++;
+            Obj::destroy(o, from);
+        }
+    }
+}
+
+void Collector::release() {
+    auto destroyAll = [](Obj*& list, pmr::memory_resource& from) {
+        while (Obj* o = list) {
+            list = o->next;
+            Obj::destroy(o, from);
+        }
+    };
+    destroyAll(objects, memory->runtime);
+    destroyAll(permanent, memory->parse);
+    for (auto& heap : memory->threadHeaps) destroyAll(heap.objects, heap.resource);
+}
+
+void* Obj::allocate(Type t, size_t size) {
+    if (ThreadHeap* heap = threadHeap) {
+        heap->counts[t]++;
+        heap->unflushed += size;
+        return heap->resource.allocate(size, alignof(Obj));
+    }
+    Memory& m = *memory;
+    Collector& c = *collector;
+    m.objects[t]++;
+    if (m.current == &m.runtime) {
+        if (c.live + c.foreign.load(memory_order_relaxed) + size > c.threshold
+            && c.busy.load(memory_order_acquire) == 0) {
+            c.collect();
+        }
+        c.live += size;
+    }
+    return m.current->allocate(size, alignof(Obj));
+}
+
+// Compile-time mirror of an Env frame: which name lives in which slot
+struct Scope {
+    unordered_map<uint32_t, int> slots;  // symbol id -> slot
+    Scope* outer;
+
+    Scope(Scope* o = nullptr) : outer(o) {}
+
+    bool has(const SymbolObj* var) const { return slots.count(var->id); }
+
+    int define(const SymbolObj* var) {
+        auto [it, added] = slots.emplace(var->id, slots.size());
+        return it->second;
+    }
+};
+
+void waitForTasks();
+void claimForWrite(Obj* o, const char* what);
+
+// The global environment is the outermost frame. Unlike call frames it
+// grows: any name not bound lexically gets a global slot when resolved.
+// Tasks on other threads may be reading the slots, so the table is only
+// reallocated once they have finished.
+struct GlobalEnv : RootSet {
+    Scope scope;
+    vector<Value> values;
+    Env* env = nullptr;
+
+    GlobalEnv() {
+        env = Env::make(0);
+    }
+
+    void markRoots() override {
+        collector->mark(env);
+        for (auto& v : values) collector->mark(v);
+    }
+
+    void grow() {
+        if (scope.slots.size() > values.capacity()) waitForTasks();
+        values.resize(scope.slots.size());
+        if (env->slots != values.data()) env->slots = values.data();
+    }
+
+    void set(string_view var, Value val) {
+        SymbolObj* name = symbols->intern(var);
+        int slot = scope.define(name);
+        grow();
+        values[slot] = val;
+        if (val.is(Obj::Proc) && !val.as<ProcObj>()->name) val.as<ProcObj>()->name = name;
+    }
+};
+
+// Lexer
+//
+// Yields tokens as string_views into the caller's buffer in a single pass,
+// so reading a large source file copies nothing but the atoms that end up
+// in symbols. Comments run from ';' to the end of the line.
+class Lexer {
+public:
+    explicit Lexer(string_view src) : src(src) {}
+
+    // Returns an empty view at end of input.
+    string_view peek() {
+        if (!ahead) {
+            current = scan();
+            ahead = true;
+        }
+        return current;
+    }
+
+    string_view next() {
+        peek();
+        ahead = false;
+        return current;
+    }
+
+    // Offset of the peeked token, or just past the last one consumed.
+    size_t offset() const {
+        return ahead ? current.data() - src.data() : pos;
+    }
+
+private:
+    string_view src;
+    size_t pos = 0;
+    string_view current;
+    bool ahead = false;
+
+    static bool isDelimiter(char c) {
+        return c == '(' || c == ')' || c == ';' || isspace((unsigned char)c);
+    }
+
+    string_view scan() {
+        while (pos < src.size()) {
+            if (isspace((unsigned char)src[pos])) {
+                pos++;
+            } else if (src[pos] == ';') {
+                while (pos < src.size() && src[pos] != '\n') pos++;
+            } else {
+                break;
+            }
+        }
+        if (pos == src.size()) return {};
+
+        size_t start = pos++;
+        if (src[start] != '(' && src[start] != ')') {
+            while (pos < src.size() && !isDelimiter(src[pos])) pos++;
+        }
+        return src.substr(start, pos - start);
+    }
+};
+
+// Reader
+//
+// Recursive descent over a Lexer cursor: each token is looked at once and
+// nothing is erased from the front of a vector.
+class Reader {
+public:
+    explicit Reader(string_view src) : lexer(src) {}
+
+    bool done() { return lexer.peek().empty(); }
+    size_t offset() const { return lexer.offset(); }
+
+    Value read() {
+        ParseScope arena;
+        return readForm();
+    }
+
+private:
+    Lexer lexer;
+
+    Value readForm() {
+        string_view token = lexer.next();
+        if (token.empty()) throw runtime_error("unexpected EOF");
+
+        if (token == "(") {
+            vector<Value> L;
+            Value tail = Value::nil();
+            while (lexer.peek() != ")") {
+                if (lexer.peek().empty()) throw runtime_error("unexpected EOF");
+                if (lexer.peek() == "." && !L.empty()) {  // (a b . tail)
+                    lexer.next();
+                    tail = readForm();
+                    if (lexer.peek() != ")") throw runtime_error("bad dotted list");
+                    break;
+                }
+                L.push_back(readForm());
+            }
+            lexer.next(); // pop ')'
+            while (!L.empty()) {
+                tail = makePair(L.back(), tail);
+                L.pop_back();
+            }
+            return tail;
+        } else if (token == ")") {
+            throw runtime_error("unexpected )");
+        }
+        return atom(token);
+    }
+
+    static Value atom(string_view token) {
+        // from_chars rejects a leading '+', which stod used to accept
+        string_view digits = token.size() > 1 && token[0] == '+' ? token.substr(1) : token;
+        bool negative = digits.size() > 1 && digits[0] == '-';
+        string_view magnitude = negative ? digits.substr(1) : digits;
+        if (!magnitude.empty() && all_of(magnitude.begin(), magnitude.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+            return parseInteger(magnitude, negative);
+        }
+        double num;
+        auto [end, ec] = from_chars(digits.data(), digits.data() + digits.size(), num);
+        if (ec == errc() && end == digits.data() + digits.size()) return Value(num);
+        return Value(symbols->intern(token));
+    }
+};
+
+PairObj* asPair(const Value& x) {
+    if (!x.is(Obj::Pair)) throw runtime_error("not a pair: " + toString(x));
+    return x.as<PairObj>();
+}
+
+// Copies a proper list's items out, for code that wants random access
+vector<Value> items(Value x) {
+    vector<Value> result;
+    for (; !x.isNil(); x = asPair(x)->cdr) result.push_back(asPair(x)->car);
+    return result;
+}
+
+void expectArgs(int argc, int n, const char* name) {
+    if (argc != n) throw runtime_error(string(name) + ": expected " + to_string(n) + (n == 1 ? " argument" : " arguments"));
+}
+
+// Call-site cache
+//
+// Remembers the builtin a two-operand call site last saw. While the callee
+// is that same object the site calls its Binary entry directly; builtins
+// are never collected, so a stale cache can only miss, not dangle. The
+// cache is one atomic word because tasks on several threads may share a
+// call site.
+struct CallCache {
+    atomic<const ProcObj*> proc{nullptr};
+
+    CallCache() = default;
+    CallCache(const CallCache& o) : proc(o.proc.load(memory_order_relaxed)) {}
+
+    Binary lookup(const Value& p) {
+        const ProcObj* cached = proc.load(memory_order_relaxed);
+        if (p.isObj() && p.obj() == cached) return cached->binary;
+        if (!p.is(Obj::Proc) || !p.as<ProcObj>()->binary) return nullptr;
+        proc.store(p.as<ProcObj>(), memory_order_relaxed);
+        return p.as<ProcObj>()->binary;
+    }
+};
+
+// Standard environment
+//
+// Builtins are allocated like parsed data, outside the collected heap.
+void standardEnv(GlobalEnv& env) {
+    ParseScope permanent;
+
+    // Partial results may be bignums, so they are rooted between steps
+    env.set("+", makeProc([](const Value* args, int argc) {
+        Value sum = Value::makeFixnum(0);
+        Root root(sum);
+        for (int i = 0; i < argc; i++) sum = add(sum, args[i]);
+        return sum;
+    }, add, true));
+
+    env.set("-", makeProc([](const Value* args, int argc) {
+        if (argc == 0) throw runtime_error("-: expected at least 1 argument");
+        if (argc == 1) return args[0].isDouble() ? Value(-args[0].number()) : sub(Value::makeFixnum(0), args[0]);
+        Value result = args[0];
+        Root root(result);
+        for (int i = 1; i < argc; i++) result = sub(result, args[i]);
+        return result;
+    }, sub, true));
+
+    env.set("*", makeProc([](const Value* args, int argc) {
+        Value product = Value::makeFixnum(1);
+        Root root(product);
+        for (int i = 0; i < argc; i++) product = mul(product, args[i]);
+        return product;
+    }, mul, true));
+
+    env.set("/", makeProc([](const Value* args, int argc) {
+        if (argc == 0) throw runtime_error("/: expected at least 1 argument");
+        if (argc == 1) return div(Value::makeFixnum(1), args[0]);
+        Value result = args[0];
+        Root root(result);
+        for (int i = 1; i < argc; i++) result = div(result, args[i]);
+        return result;
+    }, div, true));
+
+    env.set("quotient", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 2, "quotient");
+        return quotient(args[0], args[1]);
+    }, quotient, true));
+
+    env.set("remainder", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 2, "remainder");
+        return remainder(args[0], args[1]);
+    }, remainder, true));
+
+    env.set("modulo", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 2, "modulo");
+        return modulo(args[0], args[1]);
+    }, modulo, true));
+
+    env.set("<", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 2, "<");
+        return lt(args[0], args[1]);
+    }, lt, true));
+
+    env.set(">", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 2, ">");
+        return gt(args[0], args[1]);
+    }, gt, true));
+
+    env.set("=", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 2, "=");
+        return eq(args[0], args[1]);
+    }, eq, true));
+
+    env.set("list", makeProc([](const Value* args, int argc) {
+        return makeList(args, args + argc);
+    }));
+
+    env.set("car", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 1, "car");
+        return asPair(args[0])->car;
+    }, nullptr, true));
+
+    env.set("cdr", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 1, "cdr");
+        return asPair(args[0])->cdr;
+    }, nullptr, true));
+
+    env.set("cons", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 2, "cons");
+        return makePair(args[0], args[1]);
+    }));
+
+    env.set("null?", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 1, "null?");
+        return Value::makeFixnum(args[0].isNil());
+    }, nullptr, true));
+}
+
+VectorObj* asVector(const Value& x) {
+    if (!x.is(Obj::Vector)) throw runtime_error("not a vector: " + toString(x));
+    return x.as<VectorObj>();
+}
+
+HashObj* asHash(const Value& x) {
+    if (!x.is(Obj::Hash)) throw runtime_error("not a hash table: " + toString(x));
+    return x.as<HashObj>();
+}
+
+Value& vectorSlot(const Value& v, const Value& i) {
+    VectorObj* vec = asVector(v);
+    if (!i.isFixnum() || i.fixnum() < 0 || i.fixnum() >= vec->size) {
+        throw runtime_error("vector index out of range: " + toString(i));
+    }
+    return vec->items()[i.fixnum()];
+}
+
+Value vectorRef(Value v, Value i) { return vectorSlot(v, i); }
+
+Value hashRef(Value h, Value key) {
+    const Value& value = asHash(h)->find(key).value;
+    if (value.isUndefined()) throw runtime_error("hash-ref: no value for key " + toString(key));
+    return value;
+}
+
+void collectionEnv(GlobalEnv& env) {
+    ParseScope permanent;
+
+    // (make-vector n [fill]); the fill defaults to 0
+    env.set("make-vector", makeProc([](const Value* args, int argc) {
+        if (argc != 1 && argc != 2) throw runtime_error("make-vector: expected 1 or 2 arguments");
+        if (!args[0].isFixnum() || args[0].fixnum() < 0 || args[0].fixnum() > UINT32_MAX) {
+            throw runtime_error("make-vector: bad length " + toString(args[0]));
+        }
+        return makeVector(args[0].fixnum(), argc == 2 ? args[1] : Value::makeFixnum(0));
+    }));
+
+    env.set("vector", makeProc([](const Value* args, int argc) {
+        Value v = makeVector(argc, Value::nil());
+        copy(args, args + argc, v.as<VectorObj>()->items());
+        return v;
+    }));
+
+    env.set("vector-ref", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 2, "vector-ref");
+        return vectorRef(args[0], args[1]);
+    }, vectorRef));
+
+    env.set("vector-set!", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 3, "vector-set!");
+        Value v = args[0], i = args[1], x = args[2];  // claiming may run tasks, which move args
+        claimForWrite(asVector(v), "vector-set!: cannot change a vector");
+        vectorSlot(v, i) = x;
+        return Value::nil();
+    }));
+
+    env.set("vector-length", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 1, "vector-length");
+        return Value::makeFixnum(asVector(args[0])->size);
+    }));
+
+    env.set("make-hash-table", makeProc([](const Value*, int argc) {
+        expectArgs(argc, 0, "make-hash-table");
+        return makeHash();
+    }));
+
+    // (hash-ref table key [default]); a missing key without a default is an error
+    env.set("hash-ref", makeProc([](const Value* args, int argc) {
+        if (argc == 2) return hashRef(args[0], args[1]);
+        expectArgs(argc, 3, "hash-ref");
+        const Value& value = asHash(args[0])->find(args[1]).value;
+        return value.isUndefined() ? args[2] : value;
+    }, hashRef));
+
+    env.set("hash-set!", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 3, "hash-set!");
+        HashObj* table = asHash(args[0]);
+        Value key = args[1], value = args[2];  // claiming may run tasks, which move args
+        claimForWrite(table, "hash-set!: cannot change a hash table");
+        table->set(key, value);
+        return Value::nil();
+    }));
+
+    env.set("hash-count", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 1, "hash-count");
+        return makeInteger(asHash(args[0])->count);
+    }));
+}
+
+struct NativeCode;
+
+// Expressions
+//
+// The Resolver turns a parsed datum into a tree of Exp nodes: special forms
+// are decided once, and every variable carries its (depth, slot) address.
+struct Exp {
+    enum Type { Const, Var, Define, If, Lambda, Call };
+    Type type;
+    Value value;                  // Const; the source form for Lambda and Call
+    int depth = 0, slot = 0;      // Var, Define
+    const SymbolObj* name = nullptr; // Var, Define; Lambda: the name it was defined as
+    vector<const Exp*> args;      // If: test, then, else; Call: operator, operands;
+                                  // Define: value; Lambda: body
+    int arity = 0, frameSize = 0; // Lambda
+    mutable CallCache cache;      // Call with two operands
+    mutable atomic<uint64_t> count{0}; // Lambda: calls; Call: evaluations (with --profile)
+    mutable atomic<uint32_t> heat{0};  // Lambda: calls until the JIT looks at it
+    mutable atomic<NativeCode*> native{nullptr}; // Lambda: compiled code, once tried
+};
+
+// Profiler
+//
+// With --profile, every lambda and call site counts how often it runs, and
+// a SIGPROF timer samples the stack of active lambdas once per millisecond
+// of CPU time. The signal handler only copies the main thread's shadow
+// stack into a preallocated buffer; samples are folded into flamegraph
+// input ("toplevel;f;g count") when the session ends. Workers block the
+// signal, so parallel tasks show up in the counts but not in the samples.
+struct ShadowStack {
+    static constexpr int MaxDepth = 1024;  // deeper frames are counted, not recorded
+    const Exp* frames[MaxDepth];
+    atomic<int> depth{0};
+
+    void push(const Exp* lambda) {
+        int d = depth.load(memory_order_relaxed);
+        if (d < MaxDepth) frames[d] = lambda;
+        depth.store(d + 1, memory_order_release);
+    }
+
+    // A tail call takes over its caller's entry
+    void replace(const Exp* lambda) {
+        int d = depth.load(memory_order_relaxed);
+        if (d > 0 && d <= MaxDepth) frames[d - 1] = lambda;
+    }
+
+    // Only ever shrinks, so unwinding the same frames twice is harmless
+    void truncate(int n) {
+        if (n < depth.load(memory_order_relaxed)) depth.store(n, memory_order_release);
+    }
+};
+
+thread_local ShadowStack shadowStack;
+
+// The tree walker's entry for one eval activation: pushed on its first
+// lambda call, replaced on tail calls, popped when the activation exits
+struct ShadowFrame {
+    int base = -1;
+
+    ~ShadowFrame() {
+        if (base >= 0) shadowStack.truncate(base);
+    }
+
+    void enter(const Exp* lambda) {
+        lambda->count.fetch_add(1, memory_order_relaxed);
+        if (base < 0) {
+            base = shadowStack.depth.load(memory_order_relaxed);
+            shadowStack.push(lambda);
+        } else {
+            shadowStack.replace(lambda);
+        }
+    }
+};
+
+class Profiler {
+public:
+    bool enabled = false;
+
+    void start(string path) {
+        output = move(path);
+        enabled = true;
+        samples.reset(new uintptr_t[Capacity]);  // untouched pages cost nothing
+        struct sigaction action = {};
+        action.sa_handler = onSignal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, nullptr);
+        itimerval timer = {{0, Interval}, {0, Interval}};
+        setitimer(ITIMER_PROF, &timer, nullptr);
+    }
+
+    void finish(const deque<Exp>& exps, ostream& out) {
+        if (!enabled) return;
+        enabled = false;
+        itimerval off = {};
+        setitimer(ITIMER_PROF, &off, nullptr);
+        signal(SIGPROF, SIG_IGN);
+
+        // Fold identical stacks
+        unordered_map<string, size_t> stacks;
+        size_t count = 0;
+        for (size_t i = 0; i < used; i += samples[i] + 1, count++) {
+            string stack = "toplevel";
+            for (size_t j = 1; j <= samples[i]; j++) {
+                stack += ';';
+                stack += label(reinterpret_cast<const Exp*>(samples[i + j]));
+            }
+            stacks[stack]++;
+        }
+        vector<pair<string, size_t>> folded(stacks.begin(), stacks.end());
+        sort(folded.begin(), folded.end());
+        if (FILE* file = fopen(output.c_str(), "w")) {
+            for (auto& [stack, n] : folded) fprintf(file, "%s %zu\n", stack.c_str(), n);
+            fclose(file);
+        } else {
+            out << "profile: cannot write " << output << ": " << strerror(errno) << "\n";
+        }
+        out << "profile: " << count << " samples";
+        if (dropped) out << " (" << dropped << " dropped)";
+        out << " written to " << output << "\n";
+
+        vector<const Exp*> lambdas, sites;
+        size_t nodes[Exp::Call + 1] = {};
+        for (auto& exp : exps) {
+            nodes[exp.type]++;
+            if (!exp.count) continue;
+            (exp.type == Exp::Lambda ? lambdas : sites).push_back(&exp);
+        }
+        top(out, "calls by lambda", lambdas);
+        top(out, "calls by site", sites);
+
+        static const char* names[] = {"Const", "Var", "Define", "If", "Lambda", "Call"};
+        out << "exp nodes:";
+        for (int t = 0; t <= Exp::Call; t++) out << (t ? ", " : " ") << nodes[t] << " " << names[t];
+        out << endl;
+    }
+
+private:
+    static constexpr size_t Capacity = 1 << 22;  // words: a depth, then that many frames
+    static constexpr int Interval = 1000;        // microseconds
+    string output;
+    unique_ptr<uintptr_t[]> samples;
+    size_t used = 0, dropped = 0;
+
+    static void onSignal(int);
+
+    void sample() {
+        int depth = min(shadowStack.depth.load(memory_order_acquire), ShadowStack::MaxDepth);
+        if (used + depth + 1 > Capacity) {
+            dropped++;
+            return;
+        }
+        samples[used] = depth;
+        for (int i = 0; i < depth; i++) {
+            samples[used + 1 + i] = reinterpret_cast<uintptr_t>(shadowStack.frames[i]);
+        }
+        used += depth + 1;
+    }
+
+    static string label(const Exp* exp) {
+        if (exp->name) return exp->name->name;
+        return "lambda " + toString(asPair(asPair(exp->value)->cdr)->car);
+    }
+
+    static void top(ostream& out, const char* title, vector<const Exp*>& exps) {
+        if (exps.empty()) return;
+        size_t n = min(exps.size(), size_t(10));
+        partial_sort(exps.begin(), exps.begin() + n, exps.end(),
+                     [](const Exp* a, const Exp* b) { return a->count > b->count; });
+        out << title << ":\n";
+        for (size_t i = 0; i < n; i++) {
+            string source = exps[i]->type == Exp::Lambda ? label(exps[i]) : toString(exps[i]->value);
+            if (source.size() > 60) source = source.substr(0, 57) + "...";
+            out << setw(12) << exps[i]->count.load() << "  " << source << "\n";
+        }
+    }
+};
+
+// One per process, unlike the Runtime state: SIGPROF and its timer are
+// process-wide, so only main() starts it (never the embedding API)
+Profiler profiler;
+
+void Profiler::onSignal(int) {
+    profiler.sample();
+}
+
+// JIT
+//
+// A lambda that only does fixnum arithmetic is compiled to x86-64 once it
+// has been called a few hundred times. The subset is its parameters,
+// integer constants, if, two-operand calls to + - * quotient remainder
+// < > =, and calls to itself, with self tail calls compiled as jumps. The
+// lambda must be defined at top level; the globals it calls through are
+// checked against what the code was compiled for on every entry.
+//
+// Native code runs only when every argument is a fixnum. A result outside
+// the fixnum range, a division by zero or very deep recursion bails out:
+// the whole call is abandoned and interpreted instead, which is safe
+// because compiled code has no side effects. Code that keeps bailing out
+// is dropped.
+struct NativeCode {
+    static const int MaxArity = 16;
+    using Entry = int (*)(const int64_t* args, int64_t* result);  // 0 on bailout
+
+    struct Guard {
+        int slot;
+        Value expected;  // unset for the lambda's own name
+    };
+
+    Entry entry = nullptr;
+    void* memory = nullptr;
+    size_t length = 0;
+    const Env* env = nullptr;  // the global frame the guards refer to
+    vector<Guard> guards;
+    atomic<uint64_t> entries{0}, bailouts{0};
+};
+
+#if defined(__x86_64__) && defined(__linux__)
+
+// Just enough of an x86-64 encoder for the code below. rax holds the
+// current value, rcx and rdx are scratch, rbx points at the arguments,
+// r13 is the stack to bail out to and r14 the stack limit.
+class Assembler {
+public:
+    vector<uint8_t> code;
+
+    void emit(initializer_list<uint8_t> bytes) { code.insert(code.end(), bytes); }
+
+    void emit32(int32_t v) {
+        uint8_t bytes[4];
+        memcpy(bytes, &v, 4);
+        code.insert(code.end(), bytes, bytes + 4);
+    }
+
+    void emit64(int64_t v) {
+        uint8_t bytes[8];
+        memcpy(bytes, &v, 8);
+        code.insert(code.end(), bytes, bytes + 8);
+    }
+
+    // A jump or call with a rel32 operand; returns the offset to patch
+    size_t branch(initializer_list<uint8_t> op) {
+        emit(op);
+        emit32(0);
+        return code.size();
+    }
+
+    void patch(size_t at, size_t target) {
+        int32_t rel = int32_t(target) - int32_t(at);
+        memcpy(&code[at - 4], &rel, 4);
+    }
+
+    size_t here() const { return code.size(); }
+};
+
+class NativeCompiler {
+public:
+    NativeCompiler(const LambdaObj* l, NativeCode& n) : lambda(l), native(n) {}
+
+    bool compile() {
+        const Exp* code = lambda->code;
+        if (code->frameSize != code->arity || code->arity > NativeCode::MaxArity) return false;
+        if (!lambda->env || lambda->env->outer) return false;  // not defined at top level
+
+        // Entry: save callee-saved registers, set up the bailout stack and
+        // limit, call the body and store its result
+        a.emit({0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57});  // push rbx, rbp, r12-r15
+        a.emit({0x48, 0x83, 0xEC, 0x08});              // sub rsp, 8
+        a.emit({0x49, 0x89, 0xF4});                    // mov r12, rsi
+        a.emit({0x49, 0x89, 0xE5});                    // mov r13, rsp
+        a.emit({0x4C, 0x8D, 0xB4, 0x24});              // lea r14, [rsp - StackBudget]
+        a.emit32(-StackBudget);
+        calls.push_back(a.branch({0xE8}));             // call body
+        a.emit({0x49, 0x89, 0x04, 0x24});              // mov [r12], rax
+        a.emit({0xB8, 0x01, 0x00, 0x00, 0x00});        // mov eax, 1
+        size_t exit = a.here();
+        a.emit({0x48, 0x83, 0xC4, 0x08});              // add rsp, 8
+        a.emit({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3});  // pop r15-r12, rbp, rbx; ret
+
+        bail = a.here();
+        a.emit({0x4C, 0x89, 0xEC});                    // mov rsp, r13
+        a.emit({0x31, 0xC0});                          // xor eax, eax
+        a.patch(a.branch({0xE9}), exit);               // jmp exit
+
+        // Body: rdi points at the arguments
+        size_t body = a.here();
+        a.emit({0x53});                                // push rbx
+        a.emit({0x48, 0x89, 0xFB});                    // mov rbx, rdi
+        loop = a.here();
+        a.emit({0x4C, 0x39, 0xF4});                    // cmp rsp, r14
+        bailIf({0x0F, 0x82});                          // jb bail
+        if (!expression(code->args[0], true)) return false;
+        a.emit({0x5B, 0xC3});                          // pop rbx; ret
+        for (size_t at : calls) a.patch(at, body);
+        return install();
+    }
+
+private:
+    static const int32_t StackBudget = 512 * 1024;
+
+    const LambdaObj* lambda;
+    NativeCode& native;
+    Assembler a;
+    size_t bail = 0, loop = 0;
+    vector<size_t> calls;
+
+    void bailIf(initializer_list<uint8_t> jcc) {
+        a.patch(a.branch(jcc), bail);
+    }
+
+    // Bails out unless rax fits in a fixnum
+    void checkRange() {
+        a.emit({0x48, 0x89, 0xC1});                    // mov rcx, rax
+        a.emit({0x48, 0xC1, 0xE1, 0x0F});              // shl rcx, 15
+        a.emit({0x48, 0xC1, 0xF9, 0x0F});              // sar rcx, 15
+        a.emit({0x48, 0x39, 0xC1});                    // cmp rcx, rax
+        bailIf({0x0F, 0x85});                          // jne bail
+    }
+
+    // What a global operator refers to, if it is something we can compile
+    enum class Callee { None, Self, Add, Sub, Mul, Quotient, Remainder, Lt, Gt, Eq };
+
+    Callee callee(const Exp* op, size_t argc) {
+        // The global frame's slots always cover every resolved name
+        if (op->type != Exp::Var || op->depth != 1) return Callee::None;
+        Value value = lambda->env->slots[op->slot];
+        if (value.is(Obj::Lambda) && value.as<LambdaObj>()->code == lambda->code
+            && value.as<LambdaObj>()->env == lambda->env) {
+            if ((int)argc != lambda->code->arity) return Callee::None;
+            native.guards.push_back({op->slot, Value()});
+            return Callee::Self;
+        }
+        if (!value.is(Obj::Proc) || argc != 2) return Callee::None;
+        static const pair<Binary, Callee> builtins[] = {
+            {add, Callee::Add}, {sub, Callee::Sub}, {mul, Callee::Mul},
+            {quotient, Callee::Quotient}, {remainder, Callee::Remainder},
+            {lt, Callee::Lt}, {gt, Callee::Gt}, {eq, Callee::Eq},
+        };
+        for (auto& [fn, kind] : builtins) {
+            if (value.as<ProcObj>()->binary != fn) continue;
+            native.guards.push_back({op->slot, value});
+            return kind;
+        }
+        return Callee::None;
+    }
+
+    // Leaves the value of x in rax
+    bool expression(const Exp* x, bool tail) {
+        switch (x->type) {
+            case Exp::Const:
+                if (!x->value.isFixnum()) return false;
+                a.emit({0x48, 0xB8});                  // mov rax, imm64
+                a.emit64(x->value.fixnum());
+                return true;
+            case Exp::Var:
+                if (x->depth != 0) return false;
+                a.emit({0x48, 0x8B, 0x83});            // mov rax, [rbx + 8 * slot]
+                a.emit32(8 * x->slot);
+                return true;
+            case Exp::If: {
+                // Without an else branch the result may be (), not a number
+                if (x->args.size() < 3 || !expression(x->args[0], false)) return false;
+                a.emit({0x48, 0x85, 0xC0});            // test rax, rax
+                size_t toElse = a.branch({0x0F, 0x84}); // je else
+                if (!expression(x->args[1], tail)) return false;
+                size_t toEnd = a.branch({0xE9});       // jmp end
+                a.patch(toElse, a.here());
+                if (!expression(x->args[2], tail)) return false;
+                a.patch(toEnd, a.here());
+                return true;
+            }
+            case Exp::Call:
+                return call(x, tail);
+            default:
+                return false;
+        }
+    }
+
+    bool call(const Exp* x, bool tail) {
+        size_t argc = x->args.size() - 1;
+        Callee kind = callee(x->args[0], argc);
+        if (kind == Callee::None) return false;
+
+        if (kind == Callee::Self) {
+            // Arguments are pushed last first, so they sit in order at rsp
+            for (size_t i = argc; i > 0; i--) {
+                if (!expression(x->args[i], false)) return false;
+                a.emit({0x50});                        // push rax
+            }
+            if (tail) {
+                for (size_t i = 0; i < argc; i++) {
+                    a.emit({0x58});                    // pop rax
+                    a.emit({0x48, 0x89, 0x83});        // mov [rbx + 8 * i], rax
+                    a.emit32(8 * i);
+                }
+                a.patch(a.branch({0xE9}), loop);       // jmp loop
+            } else {
+                a.emit({0x48, 0x89, 0xE7});            // mov rdi, rsp
+                calls.push_back(a.branch({0xE8}));     // call body
+                a.emit({0x48, 0x81, 0xC4});            // add rsp, 8 * argc
+                a.emit32(8 * argc);
+            }
+            return true;
+        }
+
+        if (!expression(x->args[1], false)) return false;
+        a.emit({0x50});                                // push rax
+        if (!expression(x->args[2], false)) return false;
+        a.emit({0x48, 0x89, 0xC1});                    // mov rcx, rax
+        a.emit({0x58});                                // pop rax
+        switch (kind) {
+            case Callee::Add:
+                a.emit({0x48, 0x01, 0xC8});            // add rax, rcx
+                checkRange();
+                break;
+            case Callee::Sub:
+                a.emit({0x48, 0x29, 0xC8});            // sub rax, rcx
+                checkRange();
+                break;
+            case Callee::Mul:
+                a.emit({0x48, 0x0F, 0xAF, 0xC1});      // imul rax, rcx
+                bailIf({0x0F, 0x80});                  // jo bail
+                checkRange();
+                break;
+            case Callee::Quotient:
+            case Callee::Remainder:
+                a.emit({0x48, 0x85, 0xC9});            // test rcx, rcx
+                bailIf({0x0F, 0x84});                  // je bail
+                a.emit({0x48, 0x99});                  // cqo
+                a.emit({0x48, 0xF7, 0xF9});            // idiv rcx
+                if (kind == Callee::Remainder) a.emit({0x48, 0x89, 0xD0});  // mov rax, rdx
+                else checkRange();
+                break;
+            default:
+                a.emit({0x48, 0x39, 0xC8});            // cmp rax, rcx
+                a.emit({0x0F, uint8_t(kind == Callee::Lt ? 0x9C : kind == Callee::Gt ? 0x9F : 0x94), 0xC0});  // setl/setg/sete al
+                a.emit({0x0F, 0xB6, 0xC0});            // movzx eax, al
+                break;
+        }
+        return true;
+    }
+
+    // Copies the code into its own pages, which are made executable and
+    // never written again
+    bool install() {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t length = (a.code.size() + page - 1) / page * page;
+        void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return false;
+        memcpy(p, a.code.data(), a.code.size());
+        if (mprotect(p, length, PROT_READ | PROT_EXEC) != 0) {
+            munmap(p, length);
+            return false;
+        }
+        native.memory = p;
+        native.length = length;
+        native.entry = reinterpret_cast<NativeCode::Entry>(p);
+        native.env = lambda->env;
+        return true;
+    }
+};
+
+#endif
+
+class Jit {
+public:
+    bool enabled = true;
+
+    ~Jit() {
+        for (auto& code : compiled) {
+            if (code->memory) munmap(code->memory, code->length);
+        }
+    }
+
+    // Runs the lambda natively if it has been compiled and the arguments
+    // allow it; false means the caller should interpret the call
+    bool run(const LambdaObj* lambda, const Value* args, int argc, Value& result) {
+        const Exp* code = lambda->code;
+        NativeCode* native = code->native.load(memory_order_acquire);
+        if (!native) {
+            if (!enabled || profiler.enabled) return false;
+            if (code->heat.fetch_add(1, memory_order_relaxed) + 1 != Threshold) return false;
+            native = compile(lambda);
+        }
+        if (native == &rejected || lambda->env != native->env) return false;
+
+        int64_t values[NativeCode::MaxArity];
+        for (int i = 0; i < argc; i++) {
+            if (!args[i].isFixnum()) return false;
+            values[i] = args[i].fixnum();
+        }
+        for (auto& guard : native->guards) {
+            const Value& v = native->env->slots[guard.slot];
+            bool ok = guard.expected.isUndefined()
+                ? v.is(Obj::Lambda) && v.as<LambdaObj>()->code == code && v.as<LambdaObj>()->env == native->env
+                : v == guard.expected;
+            if (!ok) return false;
+        }
+
+        uint64_t entries = native->entries.fetch_add(1, memory_order_relaxed) + 1;
+        int64_t n;
+        if (native->entry(values, &n)) {
+            result = Value::makeFixnum(n);
+            return true;
+        }
+        uint64_t bailouts = native->bailouts.fetch_add(1, memory_order_relaxed) + 1;
+        if (bailouts >= 16 && bailouts * 4 > entries) code->native.store(&rejected, memory_order_release);
+        return false;
+    }
+
+private:
+    static const uint32_t Threshold = 200;
+    mutex lock;
+    deque<unique_ptr<NativeCode>> compiled;
+    NativeCode rejected;
+
+    NativeCode* compile(const LambdaObj* lambda) {
+        lock_guard<mutex> guard(lock);
+        if (NativeCode* done = lambda->code->native.load(memory_order_acquire)) return done;
+        NativeCode* result = &rejected;
+#if defined(__x86_64__) && defined(__linux__)
+        auto native = make_unique<NativeCode>();
+        if (NativeCompiler(lambda, *native).compile()) {
+            result = native.get();
+            compiled.push_back(move(native));
+        }
+#endif
+        lambda->code->native.store(result, memory_order_release);
+        return result;
+    }
+};
+
+thread_local Jit* jit = nullptr;
+
+bool isTruthy(const Value& x) {
+    if (x.isFixnum()) return x.fixnum() != 0;
+    if (x.isDouble()) return x.number() != 0;
+    return x.is(Obj::Pair) || x.is(Obj::Big);
+}
+
+// Macros
+//
+// A macro is any function from a form to its expansion. The resolver runs
+// it before looking at the form, so expansion happens once per load and
+// neither engine ever sees a macro use. define-syntax installs SyntaxRules
+// expanders; C++ code can register others with Resolver::defineMacro.
+using Expander = function<Value(const Value& form)>;
+
+// A non-hygienic syntax-rules: literals, `_`, nested patterns, dotted
+// tails, and `...` after a subpattern (followed by any fixed number of
+// further subpatterns) in both patterns and templates.
+class SyntaxRules {
+public:
+    // spec is (syntax-rules (literal ...) (pattern template) ...)
+    explicit SyntaxRules(const Value& spec) {
+        auto list = items(spec);
+        if (list.size() < 2 || list[0] != Value(symbols->intern("syntax-rules"))) {
+            throw runtime_error("bad syntax-rules");
+        }
+        for (auto& lit : items(list[1])) {
+            if (!lit.is(Obj::Symbol)) throw runtime_error("bad syntax-rules literal");
+            literals.push_back(lit.as<SymbolObj>());
+        }
+        for (size_t i = 2; i < list.size(); i++) {
+            auto rule = items(list[i]);
+            if (rule.size() != 2 || !rule[0].is(Obj::Pair)) throw runtime_error("bad syntax-rules rule");
+            rules.push_back({asPair(rule[0])->cdr, rule[1]});  // the keyword position is ignored
+        }
+    }
+
+    Value operator()(const Value& form) const {
+        for (auto& [pattern, tmpl] : rules) {
+            Bindings bindings;
+            if (match(pattern, asPair(form)->cdr, bindings)) return expand(tmpl, bindings);
+        }
+        throw runtime_error("no syntax rule matches: " + toString(form));
+    }
+
+private:
+    // What a pattern variable matched: one form, or one Match per repetition
+    struct Match {
+        Value value;
+        vector<Match> repeats;
+        bool sequence = false;
+    };
+    using Bindings = unordered_map<const SymbolObj*, Match>;
+
+    vector<const SymbolObj*> literals;
+    vector<pair<Value, Value>> rules;
+    const SymbolObj* ellipsis = symbols->intern("...");
+    const SymbolObj* wildcard = symbols->intern("_");
+
+    bool isLiteral(const SymbolObj* s) const {
+        return find(literals.begin(), literals.end(), s) != literals.end();
+    }
+
+    // Is the next item in this list `...`?
+    bool repeated(const Value& list) const {
+        Value next = asPair(list)->cdr;
+        return next.is(Obj::Pair) && asPair(next)->car == Value((Obj*)ellipsis);
+    }
+
+    static size_t length(Value list) {
+        size_t n = 0;
+        for (; list.is(Obj::Pair); list = asPair(list)->cdr) n++;
+        return n;
+    }
+
+    void variables(const Value& pattern, vector<const SymbolObj*>& out) const {
+        if (pattern.is(Obj::Symbol)) {
+            auto s = pattern.as<SymbolObj>();
+            if (s != ellipsis && s != wildcard && !isLiteral(s)) out.push_back(s);
+        } else if (pattern.is(Obj::Pair)) {
+            variables(asPair(pattern)->car, out);
+            variables(asPair(pattern)->cdr, out);
+        }
+    }
+
+    bool match(Value pattern, Value form, Bindings& bindings) const {
+        if (pattern.is(Obj::Symbol)) {
+            auto s = pattern.as<SymbolObj>();
+            if (isLiteral(s)) return form == pattern;
+            if (s != wildcard) bindings[s].value = form;
+            return true;
+        }
+        if (!pattern.is(Obj::Pair)) return form == pattern;
+
+        while (pattern.is(Obj::Pair)) {
+            Value sub = asPair(pattern)->car;
+            if (repeated(pattern)) {
+                Value rest = asPair(asPair(pattern)->cdr)->cdr;
+                size_t available = length(form), after = length(rest);
+                if (available < after) return false;
+                vector<const SymbolObj*> vars;
+                variables(sub, vars);
+                for (auto v : vars) bindings[v].sequence = true;
+                for (size_t i = 0; i < available - after; i++) {
+                    Bindings one;
+                    if (!match(sub, asPair(form)->car, one)) return false;
+                    for (auto v : vars) bindings[v].repeats.push_back(move(one[v]));
+                    form = asPair(form)->cdr;
+                }
+                pattern = rest;
+                continue;
+            }
+            if (!form.is(Obj::Pair) || !match(sub, asPair(form)->car, bindings)) return false;
+            pattern = asPair(pattern)->cdr;
+            form = asPair(form)->cdr;
+        }
+        return match(pattern, form, bindings);  // () or a dotted tail
+    }
+
+    Value expand(const Value& tmpl, const Bindings& bindings) const {
+        if (tmpl.is(Obj::Symbol)) {
+            auto it = bindings.find(tmpl.as<SymbolObj>());
+            if (it == bindings.end()) return tmpl;
+            if (it->second.sequence) throw runtime_error("missing ... after " + toString(tmpl));
+            return it->second.value;
+        }
+        if (!tmpl.is(Obj::Pair)) return tmpl;
+
+        vector<Value> out;
+        Value t = tmpl;
+        for (; t.is(Obj::Pair); t = asPair(t)->cdr) {
+            Value sub = asPair(t)->car;
+            if (!repeated(t)) {
+                out.push_back(expand(sub, bindings));
+                continue;
+            }
+            vector<const SymbolObj*> vars;
+            variables(sub, vars);
+            size_t n = SIZE_MAX;
+            for (auto v : vars) {
+                auto it = bindings.find(v);
+                if (it != bindings.end() && it->second.sequence) n = min(n, it->second.repeats.size());
+            }
+            if (n == SIZE_MAX) throw runtime_error("no repeated variable before ...");
+            for (size_t i = 0; i < n; i++) {
+                Bindings one = bindings;
+                for (auto v : vars) {
+                    auto it = bindings.find(v);
+                    if (it != bindings.end() && it->second.sequence) one[v] = it->second.repeats[i];
+                }
+                out.push_back(expand(sub, one));
+            }
+            t = asPair(t)->cdr;  // skip the ...
+        }
+        Value list = t.isNil() ? Value::nil() : expand(t, bindings);
+        while (!out.empty()) {
+            list = makePair(out.back(), list);
+            out.pop_back();
+        }
+        return list;
+    }
+};
+
+// Resolver
+//
+// Builds the Exp tree for each top-level form. Exp nodes are kept for the
+// life of the interpreter, since closures point into them.
+class Resolver {
+public:
+    Resolver(GlobalEnv& g) : globals(g) {
+        // (define-memo name f) is (define name (memoize f))
+        defineMacro("define-memo", [this](const Value& form) {
+            auto list = items(form);
+            if (list.size() != 3) throw runtime_error("bad define-memo");
+            Value call[] = {Value(memoize), list[2]};
+            Value def[] = {Value(define), list[1], makeList(call, call + 2)};
+            return makeList(def, def + 3);
+        });
+    }
+
+    void defineMacro(string_view name, Expander expander) {
+        macros[symbols->intern(name)->id] = move(expander);
+    }
+
+    const Exp* resolve(const Value& x) {
+        const Exp* exp = resolve(x, &globals.scope);
+        globals.grow();
+        return exp;
+    }
+
+    // (define-syntax name spec); the definitions are kept for save-image
+    void addSyntax(const SymbolObj* name, const Value& spec) {
+        macros[name->id] = SyntaxRules(spec);
+        syntax.emplace_back(name, spec);
+    }
+
+    const vector<pair<const SymbolObj*, Value>>& syntaxDefinitions() const { return syntax; }
+
+    const deque<Exp>& nodes() const { return exps; }
+
+    Exp* node(Exp::Type type) {
+        exps.emplace_back();
+        exps.back().type = type;
+        return &exps.back();
+    }
+
+private:
+    GlobalEnv& globals;
+    deque<Exp> exps;
+    vector<pair<const SymbolObj*, Value>> syntax;
+    SymbolObj* quote = symbols->intern("quote");
+    SymbolObj* if_ = symbols->intern("if");
+    SymbolObj* define = symbols->intern("define");
+    SymbolObj* lambda = symbols->intern("lambda");
+    SymbolObj* defineSyntax = symbols->intern("define-syntax");
+    SymbolObj* memoize = symbols->intern("memoize");
+    unordered_map<uint32_t, Expander> macros;  // by symbol id
+
+    // There is no string type: a token in double quotes, such as a file
+    // name, is a symbol that evaluates to itself
+    static bool isLiteral(const SymbolObj* sym) {
+        return sym->name.size() > 1 && sym->name.front() == '"' && sym->name.back() == '"';
+    }
+
+    static void expect(const vector<Value>& list, size_t min, size_t max, const SymbolObj* form) {
+        if (list.size() < min || list.size() > max) throw runtime_error("bad " + form->name);
+    }
+
+    const Exp* resolve(const Value& x, Scope* scope) {
+        if (x.is(Obj::Symbol) && !isLiteral(x.as<SymbolObj>())) {
+            return variable(Exp::Var, x, scope);
+        }
+        if (!x.is(Obj::Pair)) {
+            Exp* exp = node(Exp::Const);
+            exp->value = x;
+            return exp;
+        }
+
+        auto list = items(x);
+        auto& op = list[0];
+
+        if (op.is(Obj::Symbol)) {
+            const SymbolObj* form = op.as<SymbolObj>();
+            if (form == quote) {
+                expect(list, 2, 2, form);
+                Exp* exp = node(Exp::Const);
+                exp->value = list[1];
+                return exp;
+            } else if (form == if_) {
+                expect(list, 3, 4, form);
+                Exp* exp = node(Exp::If);
+                for (size_t i = 1; i < list.size(); i++) {
+                    exp->args.push_back(resolve(list[i], scope));
+                }
+                // Dead branch elimination
+                if (exp->args[0]->type == Exp::Const) {
+                    if (isTruthy(exp->args[0]->value)) return exp->args[1];
+                    if (exp->args.size() > 2) return exp->args[2];
+                    exp->type = Exp::Const;
+                    exp->value = Value::nil();
+                    exp->args.clear();
+                }
+                return exp;
+            } else if (form == define) {
+                expect(list, 3, 3, form);
+                if (!list[1].is(Obj::Symbol)) throw runtime_error("bad define");
+                Exp* exp = variable(Exp::Define, list[1], scope);
+                exp->args.push_back(resolve(list[2], scope));
+                if (exp->args[0]->type == Exp::Lambda && !exp->args[0]->name) {
+                    // Name the lambda for the profiler; every node is ours to modify
+                    const_cast<Exp*>(exp->args[0])->name = exp->name;
+                }
+                return exp;
+            } else if (form == defineSyntax) {
+                expect(list, 3, 3, form);
+                if (!list[1].is(Obj::Symbol)) throw runtime_error("bad define-syntax");
+                addSyntax(list[1].as<SymbolObj>(), list[2]);
+                Exp* exp = node(Exp::Const);
+                exp->value = list[1];
+                return exp;
+            } else if (const Expander* macro = macroFor(form, scope)) {
+                ParseScope arena;
+                return resolve((*macro)(x), scope);
+            } else if (form == lambda) {
+                expect(list, 3, 3, form);
+                Scope inner(scope);
+                int arity = 0;
+                if (!list[1].isNil()) {
+                    for (auto& p : items(list[1])) {
+                        if (!p.is(Obj::Symbol)) throw runtime_error("bad lambda");
+                        inner.define(p.as<SymbolObj>());
+                        arity++;
+                    }
+                }
+                declare(list[2], inner);
+                Exp* exp = node(Exp::Lambda);
+                exp->value = x;
+                exp->args.push_back(resolve(list[2], &inner));
+                exp->arity = arity;
+                exp->frameSize = inner.slots.size();
+                return exp;
+            }
+        }
+
+        Exp* exp = node(Exp::Call);
+        exp->value = x;
+        for (auto& item : list) {
+            exp->args.push_back(resolve(item, scope));
+        }
+        return fold(exp, scope);
+    }
+
+    // A macro named by a global, unless a local variable shadows it
+    const Expander* macroFor(const SymbolObj* name, Scope* scope) const {
+        auto it = macros.find(name->id);
+        if (it == macros.end()) return nullptr;
+        for (Scope* s = scope; s->outer; s = s->outer) {
+            if (s->has(name)) return nullptr;
+        }
+        return &it->second;
+    }
+
+    // Constant folding
+    //
+    // A call to a pure builtin with constant operands is replaced by its
+    // result. The operator must be a global that holds the builtin when the
+    // form is resolved; rebinding + later does not unfold code already
+    // loaded. Calls that would fail are left for eval to report.
+    const Exp* fold(const Exp* call, Scope* scope) {
+        const Exp* op = call->args[0];
+        if (op->type != Exp::Var) return call;
+        for (int d = 0; d < op->depth; d++) scope = scope->outer;
+        if (scope != &globals.scope || op->slot >= (int)globals.values.size()) return call;
+        const Value& proc = globals.values[op->slot];
+        if (!proc.is(Obj::Proc) || !proc.as<ProcObj>()->pure) return call;
+
+        vector<Value> operands;
+        for (size_t i = 1; i < call->args.size(); i++) {
+            if (call->args[i]->type != Exp::Const) return call;
+            operands.push_back(call->args[i]->value);
+        }
+        Exp* exp = node(Exp::Const);
+        try {
+            ParseScope permanent;  // a folded bignum lives as long as the code
+            exp->value = proc.as<ProcObj>()->call(operands.data(), operands.size());
+        } catch (const exception&) {
+            exps.pop_back();
+            return call;
+        }
+        return exp;
+    }
+
+    Exp* variable(Exp::Type type, const Value& sym, Scope* scope) {
+        Exp* exp = node(type);
+        exp->name = sym.as<SymbolObj>();
+        for (Scope* s = scope; ; s = s->outer, exp->depth++) {
+            if (s->has(exp->name) || !s->outer) {
+                exp->slot = s->define(exp->name);
+                return exp;
+            }
+        }
+    }
+
+    // Give names defined inside a lambda body a local slot up front, so
+    // references that precede the define resolve to it as well.
+    void declare(const Value& x, Scope& scope) {
+        if (!x.is(Obj::Pair)) return;
+        auto list = items(x);
+        if (list[0].is(Obj::Symbol)) {
+            const SymbolObj* form = list[0].as<SymbolObj>();
+            if (form == quote || form == lambda || form == defineSyntax) return;
+            if (form == define && list.size() > 1 && list[1].is(Obj::Symbol)) {
+                scope.define(list[1].as<SymbolObj>());
+            }
+            if (const Expander* macro = macroFor(form, &scope)) {
+                ParseScope arena;
+                return declare((*macro)(x), scope);
+            }
+        }
+        for (auto& e : list) declare(e, scope);
+    }
+};
+
+// Eval
+//
+// Expressions in tail position (the branches of an if, the body of a
+// lambda) are evaluated by looping rather than recursing, so tail calls
+// run in constant C++ stack. The caller keeps `env` reachable; frames
+// created here and intermediate values are pinned with Root guards.
+// Operands are evaluated onto one reusable stack per thread instead of a
+// fresh vector per call. It is a root, so operands already evaluated
+// survive a collection triggered by the next one.
+struct ArgStack : RootSet {
+    vector<Value> values;
+    const char* stackLimit = nullptr;  // see checkStack; here to spare eval a thread_local
+
+    void markRoots() override {
+        for (auto& v : values) collector->mark(v);
+    }
+};
+
+thread_local ArgStack* argStack = nullptr;
+
+// Recursion limit
+//
+// The tree walker recurses natively for every operand, and builtins such
+// as pmap and memoized functions re-enter either engine through apply, so
+// deep Lisp recursion would run off the end of the thread's C++ stack.
+// Instead, "recursion too deep" is raised once less than StackReserve is
+// left, which keeps room for the builtins, printer and JIT code (up to its
+// own 512 KB) that may run above the deepest check.
+const size_t StackReserve = 1024 * 1024;
+
+// The lowest address this thread's checks allow; null if it cannot be found
+const char* stackLimit() {
+    static thread_local const char* limit = nullptr;
+    static thread_local bool found = false;
+    if (found) return limit;
+    found = true;
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) return limit;
+    void* low;
+    size_t size;
+    if (pthread_attr_getstack(&attr, &low, &size) == 0 && size > 2 * StackReserve) {
+        limit = static_cast<const char*>(low) + StackReserve;
+    }
+    pthread_attr_destroy(&attr);
+    return limit;
+}
+
+inline void checkStack() {
+    char here;
+    if (&here < argStack->stackLimit) throw runtime_error("recursion too deep");
+}
+
+Value eval(const Exp* x, Env* env);
+Value callMemo(MemoObj* memo, const Value* args, int argc);
+
+Value eval(const Exp* x, Env* env) {
+    Value frame;  // keeps the current call frame alive across tail calls
+    Root frameRoot(frame);
+    ShadowFrame traced;
+
+    while (true) {
+        switch (x->type) {
+            case Exp::Const:
+                return x->value;
+            case Exp::Var: {
+                const Value& val = env->at(x->depth, x->slot);
+                if (val.isUndefined()) throw runtime_error("undefined symbol: " + x->name->name);
+                return val;
+            }
+            case Exp::Define: {
+                Value val = eval(x->args[0], env);
+                env->at(x->depth, x->slot) = val;
+                return val;
+            }
+            case Exp::If:
+                if (isTruthy(eval(x->args[0], env))) x = x->args[1];
+                else if (x->args.size() > 2) x = x->args[2];
+                else return Value::nil();
+                continue;
+            case Exp::Lambda:
+                return makeLambda(x->arity, x->frameSize, x, x->args[0], nullptr, env);
+            case Exp::Call:
+                break;
+        }
+
+        if (profiler.enabled) x->count.fetch_add(1, memory_order_relaxed);
+        auto& stack = argStack->values;
+        size_t base = stack.size();
+        int argc = x->args.size() - 1;
+        for (auto arg : x->args) {
+            Value val = eval(arg, env);
+            stack.push_back(val);
+        }
+        Value proc = stack[base];
+        const Value* args = stack.data() + base + 1;
+
+        if (proc.is(Obj::Proc)) {
+            Binary binary = argc == 2 ? x->cache.lookup(proc) : nullptr;
+            Value result = binary ? binary(args[0], args[1]) : proc.as<ProcObj>()->call(args, argc);
+            stack.resize(base);
+            return result;
+        } else if (proc.is(Obj::Lambda) && proc.as<LambdaObj>()->body) {
+            auto lambda = proc.as<LambdaObj>();
+            if (argc != lambda->arity) throw runtime_error("wrong number of arguments");
+            Value result;
+            if (jit->run(lambda, args, argc, result)) {
+                stack.resize(base);
+                return result;
+            }
+            checkStack();  // a lambda call here or in apply ends every unbounded recursion
+            if (profiler.enabled) traced.enter(lambda->code);
+            Env* callee = Env::make(lambda->frameSize, lambda->env);
+            for (int i = 0; i < argc; i++) {
+                callee->slots[i] = args[i];
+            }
+            stack.resize(base);
+            frame = callee;
+            x = lambda->body;
+            env = callee;
+            continue;
+        } else if (proc.is(Obj::Memo)) {
+            Value result = callMemo(proc.as<MemoObj>(), args, argc);
+            stack.resize(base);
+            return result;
+        }
+        throw runtime_error("not a procedure: " + toString(proc));
+    }
+}
+
+// Bytecode
+//
+// The compiler flattens an Exp tree into a Chunk of stack-machine
+// instructions, so the VM runs a flat loop instead of a recursive walk.
+enum class Op {
+    Const, Load, Store, Jump, JumpIfFalse, MakeLambda, Call, TailCall, Return,
+    Call2, TailCall2  // two-operand call; arg indexes the chunk's CallCaches
+};
+
+struct Instr {
+    Op op;
+    int arg;
+};
+
+// A resolved variable reference; the symbol is kept for error messages
+struct Ref {
+    int depth, slot;
+    const SymbolObj* name;
+};
+
+struct Chunk {
+    vector<Instr> code;
+    vector<Value> constants;
+    vector<Ref> refs;
+    vector<const Chunk*> lambdas;
+    mutable vector<CallCache> caches;
+    vector<const Exp*> sites;      // by pc: the Call node a call instruction came from
+    const Exp* lambda = nullptr;   // the Lambda node, for a lambda's chunk
+    int arity = 0, frameSize = 0;
+};
+
+class Compiler {
+public:
+    const Chunk* compileTopLevel(const Exp* x) {
+        Chunk& chunk = newChunk();
+        compile(x, chunk, true);
+        emit(chunk, Op::Return);
+        return &chunk;
+    }
+
+    // The body of a Lambda node, compiled on its own
+    const Chunk* compileLambda(const Exp* x) {
+        Chunk& fn = newChunk();
+        fn.lambda = x;
+        fn.arity = x->arity;
+        fn.frameSize = x->frameSize;
+        compile(x->args[0], fn, true);
+        emit(fn, Op::Return);
+        return &fn;
+    }
+
+private:
+    deque<Chunk> chunks;
+
+    Chunk& newChunk() {
+        chunks.emplace_back();
+        return chunks.back();
+    }
+
+    static size_t emit(Chunk& c, Op op, int arg = 0, const Exp* site = nullptr) {
+        c.code.push_back({op, arg});
+        c.sites.push_back(site);
+        return c.code.size() - 1;
+    }
+
+    static int constant(Chunk& c, const Value& value) {
+        c.constants.push_back(value);
+        return c.constants.size() - 1;
+    }
+
+    static int ref(Chunk& c, const Exp* x) {
+        c.refs.push_back({x->depth, x->slot, x->name});
+        return c.refs.size() - 1;
+    }
+
+    static void patch(Chunk& c, size_t at) {
+        c.code[at].arg = c.code.size();
+    }
+
+    // A call in tail position reuses the caller's frame (TailCall)
+    void compile(const Exp* x, Chunk& c, bool tail = false) {
+        switch (x->type) {
+            case Exp::Const:
+                emit(c, Op::Const, constant(c, x->value));
+                break;
+            case Exp::Var:
+                emit(c, Op::Load, ref(c, x));
+                break;
+            case Exp::Define:
+                compile(x->args[0], c);
+                emit(c, Op::Store, ref(c, x));
+                break;
+            case Exp::If: {
+                compile(x->args[0], c);
+                auto toElse = emit(c, Op::JumpIfFalse);
+                compile(x->args[1], c, tail);
+                auto toEnd = emit(c, Op::Jump);
+                patch(c, toElse);
+                if (x->args.size() > 2) compile(x->args[2], c, tail);
+                else emit(c, Op::Const, constant(c, Value::nil()));
+                patch(c, toEnd);
+                break;
+            }
+            case Exp::Lambda:
+                c.lambdas.push_back(compileLambda(x));
+                emit(c, Op::MakeLambda, c.lambdas.size() - 1);
+                break;
+            case Exp::Call:
+                for (auto arg : x->args) compile(arg, c);
+                if (x->args.size() == 3) {
+                    c.caches.emplace_back();
+                    emit(c, tail ? Op::TailCall2 : Op::Call2, c.caches.size() - 1, x);
+                } else {
+                    emit(c, tail ? Op::TailCall : Op::Call, x->args.size() - 1, x);
+                }
+                break;
+        }
+    }
+};
+
+// VM
+//
+// Lambda calls push a Frame instead of recursing natively, so the C++ stack
+// does not limit the depth of Lisp recursion; MaxFrames does, before the
+// frames and their environments exhaust memory. A builtin that calls back
+// into Lisp starts a nested run through apply, which checks the C++ stack.
+class VM : public RootSet {
+public:
+    static constexpr size_t MaxFrames = 1 << 20;
+
+    void markRoots() override {
+        for (auto& v : stack) collector->mark(v);
+        for (auto& f : frames) collector->mark(f.env);
+    }
+
+    Value run(const Chunk* chunk, Env* env) {
+        size_t depth = frames.size();
+        frames.push_back({chunk, 0, env});
+
+        while (true) {
+            Frame& f = frames.back();
+            const Instr& in = f.chunk->code[f.pc++];
+
+            switch (in.op) {
+                case Op::Const:
+                    stack.push_back(f.chunk->constants[in.arg]);
+                    break;
+                case Op::Load: {
+                    const Ref& r = f.chunk->refs[in.arg];
+                    const Value& val = f.env->at(r.depth, r.slot);
+                    if (val.isUndefined()) throw runtime_error("undefined symbol: " + r.name->name);
+                    stack.push_back(val);
+                    break;
+                }
+                case Op::Store: {
+                    const Ref& r = f.chunk->refs[in.arg];
+                    f.env->at(r.depth, r.slot) = stack.back();
+                    break;
+                }
+                case Op::Jump:
+                    f.pc = in.arg;
+                    break;
+                case Op::JumpIfFalse: {
+                    bool isTrue = isTruthy(stack.back());
+                    stack.pop_back();
+                    if (!isTrue) f.pc = in.arg;
+                    break;
+                }
+                case Op::MakeLambda: {
+                    auto fn = f.chunk->lambdas[in.arg];
+                    stack.push_back(makeLambda(fn->arity, fn->frameSize, fn->lambda, nullptr, fn, f.env));
+                    break;
+                }
+                case Op::Call:
+                    if (profiler.enabled) countSite(f);
+                    call(in.arg, false);
+                    break;
+                case Op::TailCall:
+                    if (profiler.enabled) countSite(f);
+                    call(in.arg, true);
+                    break;
+                case Op::Call2:
+                case Op::TailCall2: {
+                    if (profiler.enabled) countSite(f);
+                    size_t top = stack.size();
+                    if (Binary binary = f.chunk->caches[in.arg].lookup(stack[top - 3])) {
+                        stack[top - 3] = binary(stack[top - 2], stack[top - 1]);
+                        stack.resize(top - 2);
+                    } else {
+                        call(2, in.op == Op::TailCall2);
+                    }
+                    break;
+                }
+                case Op::Return: {
+                    if (frames.back().traced >= 0) shadowStack.truncate(frames.back().traced);
+                    frames.pop_back();
+                    if (frames.size() == depth) {
+                        Value result = stack.back();
+                        stack.pop_back();
+                        return result;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    void reset() {
+        frames.clear();
+        stack.clear();
+        shadowStack.truncate(0);
+    }
+
+    // Lets a caller that catches errors from a nested run drop its frames
+    pair<size_t, size_t> checkpoint() const { return {frames.size(), stack.size()}; }
+
+    void unwind(pair<size_t, size_t> mark) {
+        for (size_t i = mark.first; i < frames.size(); i++) {
+            if (frames[i].traced >= 0) {
+                shadowStack.truncate(frames[i].traced);
+                break;
+            }
+        }
+        frames.resize(mark.first);
+        stack.resize(mark.second);
+    }
+
+private:
+    struct Frame {
+        const Chunk* chunk;
+        size_t pc;
+        Env* env;
+        int traced = -1;  // with --profile, the shadow stack depth below this frame's entry
+    };
+
+    vector<Frame> frames;
+    vector<Value> stack;
+
+    static void countSite(const Frame& f) {
+        f.chunk->sites[f.pc - 1]->count.fetch_add(1, memory_order_relaxed);
+    }
+
+    void call(int argc, bool tail) {
+        size_t base = stack.size() - argc;
+        Value proc = stack[base - 1];
+
+        if (proc.is(Obj::Proc)) {
+            Value result = proc.as<ProcObj>()->call(stack.data() + base, argc);
+            stack.resize(base - 1);
+            stack.push_back(result);
+        } else if (proc.is(Obj::Lambda) && proc.as<LambdaObj>()->chunk) {
+            auto lambda = proc.as<LambdaObj>();
+            if (argc != lambda->arity) throw runtime_error("wrong number of arguments");
+            Value result;
+            if (jit->run(lambda, stack.data() + base, argc, result)) {
+                stack.resize(base - 1);
+                stack.push_back(result);
+                return;
+            }
+            if (!tail && frames.size() >= MaxFrames) throw runtime_error("recursion too deep");
+            auto newEnv = Env::make(lambda->frameSize, lambda->env);
+            for (int i = 0; i < argc; i++) {
+                newEnv->slots[i] = stack[base + i];
+            }
+            stack.resize(base - 1);
+            int traced = tail ? frames.back().traced : -1;
+            if (profiler.enabled) {
+                lambda->code->count.fetch_add(1, memory_order_relaxed);
+                if (traced >= 0) {
+                    shadowStack.replace(lambda->code);
+                } else {
+                    traced = shadowStack.depth.load(memory_order_relaxed);
+                    shadowStack.push(lambda->code);
+                }
+            }
+            if (tail) frames.back() = {lambda->chunk, 0, newEnv, traced};
+            else frames.push_back({lambda->chunk, 0, newEnv, traced});
+        } else if (proc.is(Obj::Memo)) {
+            Value result = callMemo(proc.as<MemoObj>(), stack.data() + base, argc);
+            stack.resize(base - 1);
+            stack.push_back(result);
+        } else {
+            throw runtime_error("not a procedure: " + toString(proc));
+        }
+    }
+};
+
+thread_local VM* currentVM = nullptr;
+
+// Calls any procedure from C++. Builtins that call back into Lisp must
+// copy their arguments out first: the buffer they were handed may move.
+Value apply(const Value& proc, const Value* args, int argc) {
+    if (proc.is(Obj::Proc)) return proc.as<ProcObj>()->call(args, argc);
+    if (proc.is(Obj::Memo)) return callMemo(proc.as<MemoObj>(), args, argc);
+    if (!proc.is(Obj::Lambda)) throw runtime_error("not a procedure: " + toString(proc));
+    auto lambda = proc.as<LambdaObj>();
+    if (argc != lambda->arity) throw runtime_error("wrong number of arguments");
+    Value result;
+    if (jit->run(lambda, args, argc, result)) return result;
+    checkStack();  // builtins recurse through here without a lambda call in eval
+    Value frame = Env::make(lambda->frameSize, lambda->env);
+    Root root(frame);
+    Env* env = frame.as<Env>();
+    for (int i = 0; i < argc; i++) env->slots[i] = args[i];
+    ShadowFrame traced;
+    if (profiler.enabled) traced.enter(lambda->code);
+    return lambda->body ? eval(lambda->body, env) : currentVM->run(lambda->chunk, env);
+}
+
+// Memoization
+//
+// On a miss the wrapped function runs without the lock held, so recursive
+// calls (which is where memoizing pays off) can consult the same cache.
+struct MemoStats {
+    atomic<size_t> hits{0}, misses{0}, evictions{0};
+
+    void report(ostream& out) const {
+        size_t calls = hits + misses;
+        if (!calls) return;
+        out << "memo: " << hits << " hits, " << misses << " misses ("
+            << 100.0 * hits / calls << "% hit rate), " << evictions << " evictions" << endl;
+    }
+};
+
+thread_local MemoStats* memoStats = nullptr;
+
+Value callMemo(MemoObj* memo, const Value* args, int argc) {
+    MemoObj::Key key;
+    bool cacheable = argc <= MemoObj::MaxKey;
+    for (int i = 0; cacheable && i < argc; i++) {
+        cacheable = args[i].isDouble() || args[i].isFixnum() || args[i].isNil() || args[i].is(Obj::Symbol);
+        key.bits[i] = args[i].raw();
+    }
+    key.size = argc;
+
+    if (cacheable) {
+        lock_guard<mutex> lock(memo->lock);
+        auto it = memo->index.find(key);
+        if (it != memo->index.end()) {
+            memo->hits++;
+            memoStats->hits++;
+            memo->entries.splice(memo->entries.begin(), memo->entries, it->second);
+            return it->second->second;
+        }
+    }
+
+    memo->misses++;
+    memoStats->misses++;
+    vector<Value> copy(args, args + argc);
+    Root root(copy);
+    Value fn = memo->fn;
+    Value result = apply(fn, copy.data(), argc);
+    if (!cacheable || memo->capacity == 0) return result;
+
+    lock_guard<mutex> lock(memo->lock);
+    if (memo->index.count(key)) return result;  // a recursive call got there first
+    memo->entries.emplace_front(key, result);
+    memo->index.emplace(key, memo->entries.begin());
+    if (memo->entries.size() > memo->capacity) {
+        memo->index.erase(memo->entries.back().first);
+        memo->entries.pop_back();
+        memo->evictions++;
+        memoStats->evictions++;
+    }
+    return result;
+}
+
+void memoEnv(GlobalEnv& env) {
+    ParseScope permanent;
+
+    // (memoize f [capacity]) caches up to capacity results (default 4096)
+    env.set("memoize", makeProc([](const Value* args, int argc) {
+        if (argc != 1 && argc != 2) throw runtime_error("memoize: expected 1 or 2 arguments");
+        if (!args[0].is(Obj::Proc) && !args[0].is(Obj::Lambda) && !args[0].is(Obj::Memo)) {
+            throw runtime_error("not a procedure: " + toString(args[0]));
+        }
+        double capacity = argc == 2 ? num(args[1]) : 4096;
+        if (capacity < 0) throw runtime_error("memoize: negative capacity");
+        return makeMemo(args[0], (size_t)capacity);
+    }));
+
+    // (memo-stats f) is (hits misses evictions size)
+    env.set("memo-stats", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 1, "memo-stats");
+        if (!args[0].is(Obj::Memo)) throw runtime_error("not memoized: " + toString(args[0]));
+        auto memo = args[0].as<MemoObj>();
+        size_t size;
+        {
+            lock_guard<mutex> lock(memo->lock);
+            size = memo->entries.size();
+        }
+        Value stats[] = {
+            makeInteger(memo->hits), makeInteger(memo->misses),
+            makeInteger(memo->evictions), makeInteger(size),
+        };
+        return makeList(stats, stats + 4);
+    }));
+}
+
+// Runtime binding
+//
+// An interpreter's state is reached through thread-local pointers: the
+// components declared beside their types (memory, collector, symbols,
+// jit, memoStats, pool) and what belongs to the evaluating thread itself
+// (its heap, argument stack, VM and session). A Binding is a snapshot of
+// all of them, so a runtime can be entered from any thread and pool
+// workers can be bound to the runtime that started them.
+class ThreadPool;
+struct Session;
+
+thread_local ThreadPool* pool = nullptr;
+thread_local Session* currentSession = nullptr;  // the one save-image writes out
+
+struct Binding {
+    Memory* memory;
+    Collector* collector;
+    SymbolTable* symbols;
+    Jit* jit;
+    MemoStats* memoStats;
+    ThreadPool* pool;
+    ThreadHeap* heap;
+    ArgStack* argStack;
+    VM* vm;
+    Session* session;
+
+    static Binding current() {
+        return {::memory, ::collector, ::symbols, ::jit, ::memoStats, ::pool,
+                threadHeap, ::argStack, currentVM, currentSession};
+    }
+
+    void bind() const {
+        ::memory = memory;
+        ::collector = collector;
+        ::symbols = symbols;
+        ::jit = jit;
+        ::memoStats = memoStats;
+        ::pool = pool;
+        threadHeap = heap;
+        ::argStack = argStack;
+        currentVM = vm;
+        currentSession = session;
+    }
+};
+
+// Thread pool
+//
+// A work-stealing pool behind future and pmap. Every participant, the
+// main thread included as number 0, pushes tasks onto the back of its own
+// deque and pops from there; idle threads steal from the front of the
+// others'. A thread waiting for a result runs queued tasks instead of
+// blocking, so nested futures cannot starve the pool.
+//
+// Tasks write only what no other thread can see. Code is immutable once
+// resolved, and a define inside a lambda writes to that call's own frame,
+// so globals are written only by top-level forms on the main thread.
+// Vectors and hash tables have no locks; claimForWrite guards their
+// mutation instead.
+class ThreadPool {
+public:
+    unsigned size = max(1u, thread::hardware_concurrency());
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(sleep);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    static thread_local size_t self;  // this thread's queue; 0 off the pool
+    static thread_local vector<ThreadPool*> running;  // pools whose tasks this thread is inside
+
+    // True inside a task of this pool, on a worker or inline in touch
+    bool inTask() const { return threadHeap || find(running.begin(), running.end(), this) != running.end(); }
+
+    void submit(FutureObj* task) {
+        if (queues.empty()) start();
+        currentOwner = ++owners;  // the task may see whatever was made until now
+        collector->busy++;
+        {
+            Queue& q = queues[self];
+            lock_guard<mutex> lock(q.lock);
+            q.tasks.push_back(task);
+        }
+        queued++;
+        {
+            lock_guard<mutex> lock(sleep);
+        }
+        wake.notify_one();
+    }
+
+    void waitFor(FutureObj* task) {
+        while (task->state.load(memory_order_acquire) == FutureObj::Pending) {
+            if (FutureObj* other = take()) run(other);
+            else this_thread::yield();
+        }
+    }
+
+    void waitForAll() {
+        while (collector->busy.load(memory_order_acquire) > 0) {
+            if (FutureObj* task = take()) run(task);
+            else this_thread::yield();
+        }
+    }
+
+private:
+    struct Queue {
+        mutex lock;
+        deque<FutureObj*> tasks;
+    };
+
+    static atomic<uint32_t> owners;  // process-wide, so no two tasks share an owner
+    deque<Queue> queues;
+    vector<thread> threads;
+    atomic<size_t> queued{0};
+    mutex sleep;
+    condition_variable wake;
+    bool stopping = false;
+
+    void start() {
+        queues.resize(size);
+        Binding runtime = Binding::current();
+        for (size_t i = 1; i < size; i++) {
+            runtime.heap = &memory->newThreadHeap();
+            threads.emplace_back([this, i, runtime] { work(i, runtime); });
+        }
+    }
+
+    void work(size_t index, Binding runtime) {
+        self = index;
+        runtime.bind();
+        sigset_t profiling;
+        sigemptyset(&profiling);
+        sigaddset(&profiling, SIGPROF);
+        pthread_sigmask(SIG_BLOCK, &profiling, nullptr);
+        ArgStack args;
+        args.stackLimit = stackLimit();
+        VM vm;
+        argStack = &args;
+        currentVM = &vm;
+        currentSession = nullptr;
+        while (true) {
+            if (FutureObj* task = take()) {
+                run(task);
+                continue;
+            }
+            unique_lock<mutex> lock(sleep);
+            wake.wait(lock, [this] { return stopping || queued > 0; });
+            if (stopping) return;
+        }
+    }
+
+    // Own deque first (newest task), then steal the oldest from the others
+    FutureObj* take() {
+        if (queued.load(memory_order_relaxed) == 0) return nullptr;
+        for (size_t i = 0; i < queues.size(); i++) {
+            Queue& q = queues[(self + i) % queues.size()];
+            lock_guard<mutex> lock(q.lock);
+            if (q.tasks.empty()) continue;
+            FutureObj* task;
+            if (i == 0) {
+                task = q.tasks.back();
+                q.tasks.pop_back();
+            } else {
+                task = q.tasks.front();
+                q.tasks.pop_front();
+            }
+            queued--;
+            return task;
+        }
+        return nullptr;
+    }
+
+    void run(FutureObj* task) {
+        size_t args = argStack->values.size();
+        auto mark = currentVM->checkpoint();
+        uint32_t outer = currentOwner;
+        currentOwner = ++owners;
+        running.push_back(this);
+        try {
+            task->result = apply(task->proc, &task->arg, task->hasArg ? 1 : 0);
+            task->state.store(FutureObj::Done, memory_order_release);
+        } catch (const exception& e) {
+            argStack->values.resize(args);
+            currentVM->unwind(mark);
+            task->error = e.what();
+            task->state.store(FutureObj::Failed, memory_order_release);
+        }
+        running.pop_back();
+        currentOwner = outer;
+        if (threadHeap) {
+            collector->foreign += threadHeap->unflushed;
+            threadHeap->unflushed = 0;
+        }
+        collector->busy.fetch_sub(1, memory_order_release);
+    }
+};
+
+thread_local size_t ThreadPool::self = 0;
+thread_local vector<ThreadPool*> ThreadPool::running;
+atomic<uint32_t> ThreadPool::owners{0};
+
+void waitForTasks() {
+    pool->waitForAll();
+}
+
+// Vectors and hash tables are changed in place without locks, so a write
+// must not overlap any other access. An object is private to the task that
+// made it until that task submits another, which may then see it; the main
+// thread counts as one task between submits. A task may only change its
+// own objects. The main thread may change any object once the tasks that
+// could be reading it have finished.
+void claimForWrite(Obj* o, const char* what) {
+    if (o->owner == currentOwner) return;
+    if (pool->inTask()) throw runtime_error(string(what) + " shared with other tasks");
+    waitForTasks();
+}
+
+Value touch(const Value& x) {
+    if (!x.is(Obj::Future)) return x;
+    auto future = x.as<FutureObj>();
+    pool->waitFor(future);
+    if (future->state == FutureObj::Failed) throw runtime_error(future->error);
+    return future->result;
+}
+
+// Parallel builtins
+void parallelEnv(GlobalEnv& env) {
+    ParseScope permanent;
+
+    // (future thunk) starts calling thunk on the pool and returns at once
+    env.set("future", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 1, "future");
+        FutureObj* future = makeFuture(args[0], nullptr);
+        pool->submit(future);
+        return Value(future);
+    }));
+
+    // (touch x) waits for a future's value; anything else is returned as is
+    env.set("touch", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 1, "touch");
+        return touch(args[0]);
+    }));
+
+    // (pmap f list) is map with every call to f running as its own task
+    env.set("pmap", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 2, "pmap");
+        Value f = args[0];
+        vector<Value> tasks;
+        Root root(tasks);
+        for (auto& item : items(args[1])) {
+            FutureObj* task = makeFuture(f, &item);
+            tasks.push_back(task);
+            pool->submit(task);
+        }
+        for (auto& task : tasks) task = touch(task);
+        return makeList(tasks.data(), tasks.data() + tasks.size());
+    }));
+}
+
+// Session
+//
+// The state shared by every top-level form: globals, the resolver and
+// compiler that own code for the life of the program, and the VM.
+enum class Engine { Tree, Bytecode };
 
-using ExpPtr = shared_ptr<Exp>;
-using EnvPtr = shared_ptr<Env>;
+void imageEnv(GlobalEnv& env);
+
+struct Session {
+    Engine engine;
+    GlobalEnv globals;
+    Resolver resolver{globals};
+    Compiler compiler;
+    VM vm;
+    ArgStack args;
+
+    explicit Session(Engine e) : engine(e) {
+        standardEnv(globals);
+        collectionEnv(globals);
+        parallelEnv(globals);
+        memoEnv(globals);
+        imageEnv(globals);
+        currentVM = &vm;
+        argStack = &args;
+        currentSession = this;
+    }
+
+    ~Session() {
+        profiler.finish(resolver.nodes(), cerr);
+    }
+
+    Value eval(const Value& form) {
+        args.stackLimit = stackLimit();  // an embedder may call from another thread
+        auto exp = resolver.resolve(form);
+        try {
+            return engine == Engine::Bytecode
+                ? vm.run(compiler.compileTopLevel(exp), globals.env)
+                : ::eval(exp, globals.env);
+        } catch (...) {
+            vm.reset();
+            argStack->values.clear();
+            throw;
+        }
+    }
+};
 
-// Expression types
-class Exp {
+// Source files
+//
+// Regular files are mapped read-only so the reader's string_views point
+// straight into the page cache; pipes and other streams fall back to
+// reading everything into a buffer.
+class SourceFile {
 public:
-    enum Type { Symbol, Number, List, Proc, Lambda };
-    Type type;
-    string symbol;
-    double number;
-    vector<ExpPtr> list;
-    function<ExpPtr(const vector<ExpPtr>&)> proc;
-    vector<string> params;
-    ExpPtr body;
-    EnvPtr env;
-    
-    Exp(Type t) : type(t), number(0.0) {}
-    
-    static ExpPtr makeSymbol(const string& s) {
-        auto exp = make_shared<Exp>(Symbol);
-        exp->symbol = s;
-        return exp;
+    explicit SourceFile(const char* path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) throw runtime_error(string("cannot open ") + path + ": " + strerror(errno));
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                mapped = p;
+                length = st.st_size;
+            }
+        }
+        if (!mapped) {
+            char chunk[1 << 16];
+            ssize_t n;
+            while ((n = read(fd, chunk, sizeof chunk)) > 0) buffer.append(chunk, n);
+        }
+        close(fd);
     }
-    
-    static ExpPtr makeNumber(double n) {
-        auto exp = make_shared<Exp>(Number);
-        exp->number = n;
-        return exp;
+
+    ~SourceFile() {
+        if (mapped) munmap(mapped, length);
     }
-    
-    static ExpPtr makeList(const vector<ExpPtr>& l) {
-        auto exp = make_shared<Exp>(List);
-        exp->list = l;
-        return exp;
+
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    string_view text() const {
+        return mapped ? string_view(static_cast<const char*>(mapped), length) : string_view(buffer);
     }
-    
-    static ExpPtr makeProc(function<ExpPtr(const vector<ExpPtr>&)> p) {
-        auto exp = make_shared<Exp>(Proc);
-        exp->proc = p;
-        return exp;
+
+private:
+    void* mapped = nullptr;
+    size_t length = 0;
+    string buffer;
+};
+
+// Images
+//
+// (save-image "file") writes the global environment and everything
+// reachable from it to a file; --image=file maps it back in at startup in
+// place of re-reading and re-evaluating the source that built it.
+//
+// An image is a flat array of 64-bit words: a header, one record per
+// object, one per Exp node of the saved lambdas' code, then the global and
+// syntax tables. A reference is stored where the pointer would be, as an
+// index into the object or node table (object references keep their
+// NaN-boxing tag), so loading is one pass that allocates every object and
+// a second that relocates each reference to its new address. Builtins are
+// saved by the global they were bound to and rejoined with this process's
+// functions by name, lambdas are recompiled for the bytecode engine from
+// their restored Exp trees, futures are saved as their values, and memo
+// caches start out empty.
+const uint64_t ImageMagic = 0x31474d4950534cull;  // "LSPIMG1"
+
+class ImageWriter {
+public:
+    ImageWriter(const GlobalEnv& globals, const Resolver& resolver) : globals(globals), resolver(resolver) {}
+
+    vector<uint64_t> write() {
+        add(globals.env);  // object 0, rebound rather than stored
+        vector<const SymbolObj*> names(globals.scope.slots.size());
+        for (auto [id, slot] : globals.scope.slots) names[slot] = symbols->at(id);
+        for (size_t i = 0; i < names.size(); i++) {
+            add(names[i]);
+            add(globals.values[i]);
+        }
+        for (auto& [name, spec] : resolver.syntaxDefinitions()) {
+            add(name);
+            add(spec);
+        }
+        for (size_t o = 1, e = 0; o < objects.size() || e < exps.size(); ) {
+            if (o < objects.size()) visit(objects[o++]);
+            else visit(exps[e++]);
+        }
+
+        out = {ImageMagic, objects.size(), exps.size()};
+        for (size_t i = 1; i < objects.size(); i++) record(objects[i]);
+        for (auto x : exps) record(x);
+        out.push_back(names.size());
+        for (size_t i = 0; i < names.size(); i++) {
+            out.push_back(ref(names[i]));
+            out.push_back(ref(globals.values[i]));
+        }
+        out.push_back(resolver.syntaxDefinitions().size());
+        for (auto& [name, spec] : resolver.syntaxDefinitions()) {
+            out.push_back(ref(name));
+            out.push_back(ref(spec));
+        }
+        return move(out);
     }
-    
-    static ExpPtr makeLambda(const vector<string>& parms, ExpPtr b, EnvPtr e) {
-        auto exp = make_shared<Exp>(Lambda);
-        exp->params = parms;
-        exp->body = b;
-        exp->env = e;
-        return exp;
+
+private:
+    const GlobalEnv& globals;
+    const Resolver& resolver;
+    vector<const Obj*> objects;
+    vector<const Exp*> exps;
+    unordered_map<const Obj*, uint64_t> objectIndex;
+    unordered_map<const Exp*, uint64_t> expIndex;
+    vector<uint64_t> out;
+
+    void add(const Obj* o) {
+        if (o && objectIndex.emplace(o, objects.size()).second) objects.push_back(o);
     }
-    
-    string toString() const {
-        switch (type) {
-            case Symbol: return symbol;
-            case Number: return to_string(number);
-            case List: {
-                string result = "(";
-                for (size_t i = 0; i < list.size(); i++) {
-                    if (i > 0) result += " ";
-                    result += list[i]->toString();
+
+    void add(const Value& v) {
+        Value x = touch(v);
+        if (x.isObj()) add(x.obj());
+    }
+
+    void add(const Exp* x) {
+        if (expIndex.emplace(x, exps.size()).second) exps.push_back(x);
+    }
+
+    void visit(const Obj* o) {
+        switch (o->type) {
+            case Obj::Pair:
+                add(static_cast<const PairObj*>(o)->car);
+                add(static_cast<const PairObj*>(o)->cdr);
+                break;
+            case Obj::Lambda:
+                add(static_cast<const LambdaObj*>(o)->code);
+                add(static_cast<const LambdaObj*>(o)->env);
+                break;
+            case Obj::Frame: {
+                auto env = static_cast<const Env*>(o);
+                add(env->outer);
+                for (uint32_t i = 0; i < env->size; i++) add(env->slots[i]);
+                break;
+            }
+            case Obj::Memo:
+                add(static_cast<const MemoObj*>(o)->fn);
+                break;
+            case Obj::Vector: {
+                auto v = const_cast<VectorObj*>(static_cast<const VectorObj*>(o));
+                for (uint32_t i = 0; i < v->size; i++) add(v->items()[i]);
+                break;
+            }
+            case Obj::Hash:
+                for (auto& e : static_cast<const HashObj*>(o)->entries) {
+                    add(e.key);
+                    add(e.value);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void visit(const Exp* x) {
+        add(x->value);
+        add(x->name);
+        for (auto arg : x->args) add(arg);
+    }
+
+    uint64_t ref(const Obj* o) {
+        return o ? Value(reinterpret_cast<Obj*>(objectIndex.at(o))).raw() : Value().raw();
+    }
+
+    uint64_t ref(const Value& v) {
+        Value x = touch(v);
+        return x.isObj() ? ref(x.obj()) : x.raw();
+    }
+
+    void putString(const string& s) {
+        out.push_back(s.size());
+        size_t at = out.size();
+        out.resize(at + (s.size() + 7) / 8);
+        memcpy(&out[at], s.data(), s.size());
+    }
+
+    // A header word (type, parsed flag, length in words) and the fields
+    void record(const Obj* o) {
+        size_t header = out.size();
+        out.push_back(0);
+        switch (o->type) {
+            case Obj::Symbol:
+                putString(static_cast<const SymbolObj*>(o)->name);
+                break;
+            case Obj::Pair:
+                out.push_back(ref(static_cast<const PairObj*>(o)->car));
+                out.push_back(ref(static_cast<const PairObj*>(o)->cdr));
+                break;
+            case Obj::Proc: {
+                auto name = static_cast<const ProcObj*>(o)->name;
+                if (!name) throw runtime_error("save-image: cannot save an unnamed builtin");
+                putString(name->name);
+                break;
+            }
+            case Obj::Lambda: {
+                auto lambda = static_cast<const LambdaObj*>(o);
+                out.insert(out.end(), {uint64_t(lambda->arity), uint64_t(lambda->frameSize),
+                                       expIndex.at(lambda->code), ref(lambda->env)});
+                break;
+            }
+            case Obj::Frame: {
+                auto env = static_cast<const Env*>(o);
+                out.insert(out.end(), {env->size, ref(env->outer)});
+                for (uint32_t i = 0; i < env->size; i++) out.push_back(ref(env->slots[i]));
+                break;
+            }
+            case Obj::Memo: {
+                auto memo = static_cast<const MemoObj*>(o);
+                out.insert(out.end(), {memo->capacity, ref(memo->fn)});
+                break;
+            }
+            case Obj::Big: {
+                auto big = static_cast<const BigObj*>(o);
+                out.insert(out.end(), {uint64_t(big->negative), big->length});
+                size_t at = out.size();
+                out.resize(at + (big->length + 1) / 2);
+                memcpy(&out[at], big->limbs(), big->length * sizeof(uint32_t));
+                break;
+            }
+            case Obj::Vector: {
+                auto v = const_cast<VectorObj*>(static_cast<const VectorObj*>(o));
+                out.push_back(v->size);
+                for (uint32_t i = 0; i < v->size; i++) out.push_back(ref(v->items()[i]));
+                break;
+            }
+            case Obj::Hash: {
+                auto h = static_cast<const HashObj*>(o);
+                out.push_back(h->count);
+                for (auto& e : h->entries) {
+                    if (e.key.isUndefined()) continue;
+                    out.push_back(ref(e.key));
+                    out.push_back(ref(e.value));
                 }
-                return result + ")";
+                break;
             }
-            case Proc: return "<procedure>";
-            case Lambda: return "<lambda>";
+            default:
+                throw runtime_error("save-image: cannot save " + toString(Value(const_cast<Obj*>(o))));
         }
-        return "";
+        out[header] = o->type | uint64_t(o->parsed) << 8 | uint64_t(out.size() - header - 1) << 32;
+    }
+
+    void record(const Exp* x) {
+        size_t header = out.size();
+        out.insert(out.end(), {0, ref(x->value), uint64_t(x->depth), uint64_t(x->slot), ref(x->name),
+                               uint64_t(x->arity), uint64_t(x->frameSize), x->args.size()});
+        for (auto arg : x->args) out.push_back(expIndex.at(arg));
+        out[header] = x->type | uint64_t(out.size() - header - 1) << 32;
     }
 };
 
-// Environment
-class Env {
+// Waits for every task first, so it cannot run as one of them: the wait
+// would include the caller's own task and never end
+void saveImage(Session& session, const string& path) {
+    if (pool->inTask()) throw runtime_error("save-image: cannot save from inside a future or pmap task");
+    waitForTasks();
+    vector<uint64_t> words = ImageWriter(session.globals, session.resolver).write();
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) throw runtime_error("cannot write " + path + ": " + strerror(errno));
+    size_t written = fwrite(words.data(), sizeof(uint64_t), words.size(), f);
+    if (fclose(f) != 0 || written != words.size()) {
+        throw runtime_error("cannot write " + path + ": " + strerror(errno));
+    }
+}
+
+class ImageReader {
 public:
-    map<string, ExpPtr> data;
-    EnvPtr outer;
-    
-    Env(EnvPtr o = nullptr) : outer(o) {}
-    
-    ExpPtr find(const string& var) {
-        if (data.count(var)) return data[var];
-        if (outer) return outer->find(var);
-        return nullptr;
+    ImageReader(Session& session, string_view bytes, const char* path) : session(session), path(path) {
+        if (bytes.size() % sizeof(uint64_t)) corrupt();
+        at = reinterpret_cast<const uint64_t*>(bytes.data());
+        end = at + bytes.size() / sizeof(uint64_t);
     }
-    
-    void set(const string& var, ExpPtr val) {
-        data[var] = val;
-    }
-};
-
-// Tokenize
-vector<string> tokenize(const string& str) {
-    vector<string> tokens;
-    string s = str;
-    
-    // Replace parens with spaces
-    for (size_t i = 0; i < s.length(); i++) {
-        if (s[i] == '(' || s[i] == ')') {
-            s.insert(i, " ");
-            s.insert(i + 2, " ");
-            i += 2;
-        }
-    }
-    
-    // Split by whitespace
-    istringstream iss(s);
-    string token;
-    while (iss >> token) {
-        tokens.push_back(token);
-    }
-    
-    return tokens;
-}
-
-// Parse
-ExpPtr readFromTokens(vector<string>& tokens) {
-    if (tokens.empty()) throw runtime_error("unexpected EOF");
-    
-    string token = tokens[0];
-    tokens.erase(tokens.begin());
-    
-    if (token == "(") {
-        vector<ExpPtr> L;
-        while (tokens[0] != ")") {
-            L.push_back(readFromTokens(tokens));
-        }
-        tokens.erase(tokens.begin()); // pop ')'
-        return Exp::makeList(L);
-    } else if (token == ")") {
-        throw runtime_error("unexpected )");
-    } else {
-        // Try to parse as number
-        try {
-            size_t pos;
-            double num = stod(token, &pos);
-            if (pos == token.length()) {
-                return Exp::makeNumber(num);
+
+    void read() {
+        if (at == end || *at != ImageMagic) throw runtime_error(string(path) + ": not an image");
+        at++;
+        uint64_t objectCount = next(), nodeCount = next();
+        // Every record is at least its header word
+        uint64_t left = end - at;
+        if (objectCount == 0 || objectCount - 1 > left || nodeCount > left - (objectCount - 1)) corrupt();
+        objects.resize(objectCount);
+        nodes.resize(nodeCount);
+        Root root(objects);
+
+        unordered_map<string_view, Value> builtins;
+        for (auto& v : session.globals.values) {
+            if (v.is(Obj::Proc) && v.as<ProcObj>()->name) builtins.emplace(v.as<ProcObj>()->name->name, v);
+        }
+
+        // Allocate, checking each record's counts against its length so that
+        // the relocation pass can read the fields without bounds checks
+        vector<const uint64_t*> records(objects.size());
+        objects[0] = session.globals.env;
+        for (size_t i = 1; i < objects.size(); i++) {
+            uint64_t header = next();
+            auto type = Obj::Type(header & 0xff);
+            bool parsed = header >> 8 & 1;
+            uint64_t words = header >> 32;
+            records[i] = at;
+            skip(words);
+            const uint64_t* p = records[i];
+            if (parsed) {
+                ParseScope permanent;
+                objects[i] = allocate(type, p, words, builtins);
+            } else {
+                objects[i] = allocate(type, p, words, builtins);
+            }
+        }
+        vector<const uint64_t*> expRecords(nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++) {
+            uint64_t header = next();
+            uint64_t words = header >> 32;
+            if ((header & 0xff) > Exp::Call || words < 7) corrupt();
+            nodes[i] = session.resolver.node(Exp::Type(header & 0xff));
+            expRecords[i] = at;
+            skip(words);
+            if (expRecords[i][6] != words - 7) corrupt();
+        }
+
+        // Relocate: code first, so lambdas can be compiled from it
+        for (size_t i = 0; i < nodes.size(); i++) fill(nodes[i], expRecords[i]);
+        for (size_t i = 1; i < objects.size(); i++) fill(objects[i], records[i]);
+
+        auto& globals = session.globals;
+        size_t count = next();
+        vector<Value> values;
+        for (size_t i = 0; i < count; i++) {
+            const SymbolObj* name = symbol(next());
+            if (!name || globals.scope.define(name) != int(i)) {
+                throw runtime_error(string(path) + ": saved by a different build of the interpreter");
             }
-        } catch (...) {}
-        return Exp::makeSymbol(token);
+            values.push_back(value(next()));
+        }
+        globals.grow();
+        copy(values.begin(), values.end(), globals.values.begin());
+        count = next();
+        for (size_t i = 0; i < count; i++) {
+            const SymbolObj* name = symbol(next());
+            if (!name) corrupt();
+            session.resolver.addSyntax(name, value(next()));
+        }
+        if (at != end) corrupt();
     }
-}
 
-ExpPtr parse(const string& program) {
-    auto tokens = tokenize(program);
-    return readFromTokens(tokens);
+private:
+    Session& session;
+    const char* path;
+    const uint64_t *at, *end;
+    vector<Value> objects;
+    vector<Exp*> nodes;
+    unordered_map<const Exp*, const Chunk*> chunks;  // closures share their code
+
+    [[noreturn]] void corrupt() const {
+        throw runtime_error(string(path) + ": corrupt image");
+    }
+
+    uint64_t next() {
+        if (at == end) corrupt();
+        return *at++;
+    }
+
+    void skip(uint64_t words) {
+        if (words > uint64_t(end - at)) corrupt();
+        at += words;
+    }
+
+    // A record of `words` words must be exactly `size` long
+    void expect(uint64_t words, uint64_t size) const {
+        if (words != size) corrupt();
+    }
+
+    // A length-prefixed string that fills the rest of its record
+    string_view text(const uint64_t* p, uint64_t words) const {
+        if (words == 0 || p[0] > (words - 1) * 8) corrupt();
+        expect(words, 1 + (p[0] + 7) / 8);
+        return string_view(reinterpret_cast<const char*>(p + 1), p[0]);
+    }
+
+    // Object sizes are 32-bit in memory
+    uint32_t count(const uint64_t* p, uint64_t words) const {
+        if (words == 0 || p[0] > UINT32_MAX) corrupt();
+        return uint32_t(p[0]);
+    }
+
+    Value allocate(Obj::Type type, const uint64_t* p, uint64_t words,
+                   const unordered_map<string_view, Value>& builtins) {
+        switch (type) {
+            case Obj::Symbol:
+                return symbols->intern(text(p, words));
+            case Obj::Pair:
+                expect(words, 2);
+                return makePair(Value(), Value());
+            case Obj::Proc: {
+                auto it = builtins.find(text(p, words));
+                if (it == builtins.end()) throw runtime_error(string(path) + ": no builtin " + string(text(p, words)));
+                return it->second;
+            }
+            case Obj::Lambda:
+                expect(words, 4);
+                if (p[0] > p[1] || p[1] > INT32_MAX) corrupt();
+                return makeLambda(p[0], p[1], nullptr, nullptr, nullptr, nullptr);
+            case Obj::Frame: {
+                uint32_t size = count(p, words);
+                expect(words, 2 + uint64_t(size));
+                return Env::make(size);
+            }
+            case Obj::Memo:
+                expect(words, 2);
+                return makeMemo(Value(), p[0]);
+            case Obj::Big: {
+                if (words < 2 || p[1] > UINT32_MAX) corrupt();
+                expect(words, 2 + (p[1] + 1) / 2);
+                Integer x{p[0] != 0, Limbs(p[1])};
+                memcpy(x.mag.data(), p + 2, p[1] * sizeof(uint32_t));
+                return makeInteger(move(x));
+            }
+            case Obj::Vector: {
+                uint32_t size = count(p, words);
+                expect(words, 1 + uint64_t(size));
+                return makeVector(size, Value());
+            }
+            case Obj::Hash:
+                if (words == 0 || p[0] != (words - 1) / 2) corrupt();
+                expect(words, 1 + 2 * p[0]);
+                return makeHash();
+            default:
+                corrupt();
+        }
+    }
+
+    Value value(uint64_t bits) const {
+        Value v = Value::fromRaw(bits);
+        if (!v.isObj()) return v;
+        auto index = reinterpret_cast<uintptr_t>(v.obj());
+        if (index >= objects.size()) corrupt();
+        return objects[index];
+    }
+
+    const SymbolObj* symbol(uint64_t bits) const {
+        Value v = value(bits);
+        if (v.isUndefined()) return nullptr;
+        if (!v.is(Obj::Symbol)) corrupt();
+        return v.as<SymbolObj>();
+    }
+
+    Env* frame(uint64_t bits) const {
+        Value v = value(bits);
+        if (v.isUndefined()) return nullptr;
+        if (!v.is(Obj::Frame)) corrupt();
+        return v.as<Env>();
+    }
+
+    const Exp* node(uint64_t index) const {
+        if (index >= nodes.size()) corrupt();
+        return nodes[index];
+    }
+
+    void fill(Exp* x, const uint64_t* p) {
+        x->value = value(p[0]);
+        x->depth = p[1];
+        x->slot = p[2];
+        x->name = symbol(p[3]);
+        x->arity = p[4];
+        x->frameSize = p[5];
+        for (uint64_t i = 0; i < p[6]; i++) x->args.push_back(node(p[7 + i]));
+        if (x->type == Exp::Lambda && (x->args.empty() || x->arity < 0 || x->arity > x->frameSize)) corrupt();
+    }
+
+    void fill(Value& v, const uint64_t* p) {
+        if (!v.isObj() || v.obj()->type == Obj::Symbol || v.obj()->type == Obj::Proc) return;
+        switch (v.obj()->type) {
+            case Obj::Pair:
+                v.as<PairObj>()->car = value(p[0]);
+                v.as<PairObj>()->cdr = value(p[1]);
+                break;
+            case Obj::Lambda: {
+                auto lambda = v.as<LambdaObj>();
+                lambda->code = node(p[2]);
+                lambda->env = frame(p[3]);
+                if (lambda->code->type != Exp::Lambda || !lambda->env) corrupt();
+                if (lambda->arity != lambda->code->arity || lambda->frameSize != lambda->code->frameSize) corrupt();
+                if (session.engine == Engine::Bytecode) {
+                    auto& chunk = chunks[lambda->code];
+                    if (!chunk) chunk = session.compiler.compileLambda(lambda->code);
+                    lambda->chunk = chunk;
+                } else {
+                    lambda->body = lambda->code->args[0];
+                }
+                break;
+            }
+            case Obj::Frame: {
+                auto env = v.as<Env>();
+                env->outer = frame(p[1]);
+                for (uint32_t i = 0; i < env->size; i++) env->slots[i] = value(p[2 + i]);
+                break;
+            }
+            case Obj::Memo:
+                v.as<MemoObj>()->fn = value(p[1]);
+                break;
+            case Obj::Vector: {
+                auto vec = v.as<VectorObj>();
+                for (uint32_t i = 0; i < vec->size; i++) vec->items()[i] = value(p[1 + i]);
+                break;
+            }
+            case Obj::Hash:
+                for (uint64_t i = 0; i < p[0]; i++) v.as<HashObj>()->set(value(p[1 + 2 * i]), value(p[2 + 2 * i]));
+                break;
+            default:
+                break;
+        }
+    }
+};
+
+void loadImage(Session& session, const char* path) {
+    SourceFile file(path);
+    ImageReader(session, file.text(), path).read();
 }
 
-// Standard environment
-EnvPtr standardEnv() {
-    auto env = make_shared<Env>();
-    
-    env->set("+", Exp::makeProc([](const vector<ExpPtr>& args) {
-        double sum = 0;
-        for (auto& arg : args) sum += arg->number;
-        return Exp::makeNumber(sum);
-    }));
-    
-    env->set("-", Exp::makeProc([](const vector<ExpPtr>& args) {
-        if (args.size() == 1) return Exp::makeNumber(-args[0]->number);
-        double result = args[0]->number;
-        for (size_t i = 1; i < args.size(); i++) result -= args[i]->number;
-        return Exp::makeNumber(result);
-    }));
-    
-    env->set("*", Exp::makeProc([](const vector<ExpPtr>& args) {
-        double product = 1;
-        for (auto& arg : args) product *= arg->number;
-        return Exp::makeNumber(product);
-    }));
-    
-    env->set("/", Exp::makeProc([](const vector<ExpPtr>& args) {
-        double result = args[0]->number;
-        for (size_t i = 1; i < args.size(); i++) result /= args[i]->number;
-        return Exp::makeNumber(result);
-    }));
-    
-    env->set("<", Exp::makeProc([](const vector<ExpPtr>& args) {
-        return Exp::makeNumber(args[0]->number < args[1]->number ? 1 : 0);
-    }));
-    
-    env->set(">", Exp::makeProc([](const vector<ExpPtr>& args) {
-        return Exp::makeNumber(args[0]->number > args[1]->number ? 1 : 0);
-    }));
-    
-    env->set("=", Exp::makeProc([](const vector<ExpPtr>& args) {
-        return Exp::makeNumber(args[0]->number == args[1]->number ? 1 : 0);
-    }));
-    
-    env->set("list", Exp::makeProc([](const vector<ExpPtr>& args) {
-        return Exp::makeList(args);
-    }));
-    
-    env->set("car", Exp::makeProc([](const vector<ExpPtr>& args) {
-        return args[0]->list[0];
-    }));
-    
-    env->set("cdr", Exp::makeProc([](const vector<ExpPtr>& args) {
-        vector<ExpPtr> tail(args[0]->list.begin() + 1, args[0]->list.end());
-        return Exp::makeList(tail);
-    }));
-    
-    env->set("cons", Exp::makeProc([](const vector<ExpPtr>& args) {
-        vector<ExpPtr> result = {args[0]};
-        result.insert(result.end(), args[1]->list.begin(), args[1]->list.end());
-        return Exp::makeList(result);
+void imageEnv(GlobalEnv& env) {
+    ParseScope permanent;
+
+    // (save-image "file") saves the globals; --image=file starts from them
+    env.set("save-image", makeProc([](const Value* args, int argc) {
+        expectArgs(argc, 1, "save-image");
+        if (pool->inTask()) throw runtime_error("save-image: cannot save from inside a future or pmap task");
+        if (!args[0].is(Obj::Symbol)) throw runtime_error("save-image: expected a file name");
+        string path = args[0].as<SymbolObj>()->name;
+        if (path.size() > 1 && path.front() == '"' && path.back() == '"') path = path.substr(1, path.size() - 2);
+        saveImage(*currentSession, path);
+        return args[0];
     }));
-    
-    return env;
 }
 
-// Eval
-ExpPtr eval(ExpPtr x, EnvPtr env);
-
-ExpPtr eval(ExpPtr x, EnvPtr env) {
-    if (x->type == Exp::Symbol) {
-        auto val = env->find(x->symbol);
-        if (!val) throw runtime_error("undefined symbol: " + x->symbol);
-        return val;
-    } else if (x->type == Exp::Number) {
-        return x;
-    } else if (x->type == Exp::List) {
-        if (x->list.empty()) return x;
-        
-        auto& op = x->list[0];
-        
-        if (op->type == Exp::Symbol) {
-            if (op->symbol == "quote") {
-                return x->list[1];
-            } else if (op->symbol == "if") {
-                auto test = eval(x->list[1], env);
-                bool isTrue = (test->type == Exp::Number && test->number != 0) ||
-                             (test->type == Exp::List && !test->list.empty());
-                return eval(x->list[isTrue ? 2 : 3], env);
-            } else if (op->symbol == "define") {
-                auto val = eval(x->list[2], env);
-                env->set(x->list[1]->symbol, val);
-                return val;
-            } else if (op->symbol == "lambda") {
-                vector<string> params;
-                for (auto& p : x->list[1]->list) {
-                    params.push_back(p->symbol);
-                }
-                return Exp::makeLambda(params, x->list[2], env);
+// Runtimes
+//
+// A Runtime owns everything one interpreter needs: heap and collector,
+// symbols, JIT, thread pool, memo counters and the session. Runtimes share
+// nothing, so separate ones can run on separate threads at once; each is
+// used by one thread at a time (plus its own pool workers). A RuntimeScope
+// binds a runtime to the calling thread and restores the previous binding
+// when it ends. It also sets the thread's Root guards aside meanwhile, so a
+// native function may call into another interpreter.
+struct RuntimeOptions {
+    Engine engine = Engine::Tree;
+    AllocStrategy alloc = AllocStrategy::Pooled;
+    double gcGrowth = 2.0;
+    unsigned threads = 0;  // 0 for one per core
+    bool jit = true;
+};
+
+class Runtime {
+public:
+    Memory memory;
+    Collector collector;
+    SymbolTable symbols;
+    Jit jit;
+    MemoStats memoStats;
+    ThreadPool pool;
+    deque<Callback> callbacks;  // never moved, so ProcObjs can point at them
+    unique_ptr<Session> session;
+
+    explicit Runtime(const RuntimeOptions& options);
+    ~Runtime();
+
+    Binding binding() {
+        return {&memory, &collector, &symbols, &jit, &memoStats, &pool, nullptr,
+                &session->args, &session->vm, session.get()};
+    }
+};
+
+class RuntimeScope {
+public:
+    explicit RuntimeScope(Runtime& runtime) : RuntimeScope(runtime.binding()) {}
+
+    explicit RuntimeScope(const Binding& binding) : saved(Binding::current()), self(ThreadPool::self) {
+        binding.bind();
+        ThreadPool::self = 0;
+        swap(roots, Collector::roots);
+        swap(rootVectors, Collector::rootVectors);
+    }
+
+    ~RuntimeScope() {
+        swap(roots, Collector::roots);
+        swap(rootVectors, Collector::rootVectors);
+        ThreadPool::self = self;
+        saved.bind();
+    }
+
+    RuntimeScope(const RuntimeScope&) = delete;
+    RuntimeScope& operator=(const RuntimeScope&) = delete;
+
+private:
+    Binding saved;
+    size_t self;
+    vector<Value*> roots;
+    vector<vector<Value>*> rootVectors;
+};
+
+Runtime::Runtime(const RuntimeOptions& options) {
+    memory.use(options.alloc);
+    collector.growth = options.gcGrowth;
+    if (options.threads) pool.size = options.threads;
+    jit.enabled = options.jit;
+    // The session's root sets register with the collector as they are built
+    RuntimeScope bound({&memory, &collector, &symbols, &jit, &memoStats, &pool, nullptr, nullptr, nullptr, nullptr});
+    session = make_unique<Session>(options.engine);
+}
+
+Runtime::~Runtime() {
+    RuntimeScope bound(*this);
+    pool.waitForAll();
+    session.reset();
+    collector.release();
+}
+
+}  // namespace
+
+// Embedding API
+//
+// lisp.hpp's Interpreter is a Runtime behind a pointer. Values cross the
+// boundary as Datums, copied in and out under the runtime's scope, so the
+// host never holds anything the collector could move or free.
+namespace lisp {
+namespace {
+
+Datum toDatum(const Value& x) {
+    Datum d;
+    if (x.isNil()) return d;
+    if (x.isFixnum()) return Datum(int64_t(x.fixnum()));
+    if (x.isDouble()) return Datum(x.number());
+    if (x.is(Obj::Symbol)) return Datum::symbol(x.as<SymbolObj>()->name);
+    if (x.is(Obj::Big)) {
+        d.kind = Datum::Integer;
+        d.text = toString(x);
+        auto [end, error] = from_chars(d.text.data(), d.text.data() + d.text.size(), d.integer);
+        if (error == errc() && end == d.text.data() + d.text.size()) d.text.clear();
+        return d;
+    }
+    if (x.is(Obj::Pair)) {
+        Value rest = x;
+        for (; rest.is(Obj::Pair); rest = rest.as<PairObj>()->cdr) {
+            d.items.push_back(toDatum(rest.as<PairObj>()->car));
+        }
+        if (rest.isNil()) {
+            d.kind = Datum::List;
+            return d;
+        }
+        d.items.clear();
+    }
+    d.kind = Datum::Other;
+    d.text = toString(x);
+    return d;
+}
+
+Value fromDatum(const Datum& d) {
+    switch (d.kind) {
+        case Datum::Nil:
+            return Value::nil();
+        case Datum::Integer: {
+            if (d.text.empty()) return makeInteger(d.integer);
+            string_view digits = d.text;
+            bool negative = digits[0] == '-';
+            if (negative) digits.remove_prefix(1);
+            if (digits.empty() || !all_of(digits.begin(), digits.end(), [](char c) { return isdigit((unsigned char)c); })) {
+                throw runtime_error("not an integer: " + d.text);
             }
+            return parseInteger(digits, negative);
         }
-        
-        auto proc = eval(op, env);
-        vector<ExpPtr> args;
-        for (size_t i = 1; i < x->list.size(); i++) {
-            args.push_back(eval(x->list[i], env));
+        case Datum::Real:
+            return Value(d.real);
+        case Datum::Symbol:
+            return symbols->intern(d.text);
+        case Datum::List: {
+            vector<Value> items;
+            Root root(items);
+            for (auto& item : d.items) items.push_back(fromDatum(item));
+            return makeList(items.data(), items.data() + items.size());
         }
-        
-        if (proc->type == Exp::Proc) {
-            return proc->proc(args);
-        } else if (proc->type == Exp::Lambda) {
-            auto newEnv = make_shared<Env>(proc->env);
-            for (size_t i = 0; i < proc->params.size(); i++) {
-                newEnv->set(proc->params[i], args[i]);
+        default:
+            throw runtime_error("cannot pass " + d.text + " to Lisp");
+    }
+}
+
+}  // namespace
+
+Datum Datum::symbol(std::string name) {
+    Datum d;
+    d.kind = Symbol;
+    d.text = move(name);
+    return d;
+}
+
+Datum Datum::list(std::vector<Datum> items) {
+    Datum d;
+    d.kind = List;
+    d.items = move(items);
+    return d;
+}
+
+std::string Datum::str() const {
+    switch (kind) {
+        case Nil: return "()";
+        case Integer: return text.empty() ? to_string(integer) : text;
+        case Real: return formatNumber(Value(real));
+        case List: {
+            string s = "(";
+            for (size_t i = 0; i < items.size(); i++) {
+                if (i) s += ' ';
+                s += items[i].str();
             }
-            return eval(proc->body, newEnv);
+            return s + ")";
         }
+        default: return text;
     }
-    
-    return x;
 }
 
+struct Interpreter::Impl {
+    Runtime runtime;
+    explicit Impl(const RuntimeOptions& options) : runtime(options) {}
+};
+
+Interpreter::Interpreter() : Interpreter(Options()) {}
+
+Interpreter::Interpreter(const Options& options) {
+    RuntimeOptions o;
+    o.engine = options.bytecode ? Engine::Bytecode : Engine::Tree;
+    o.gcGrowth = options.gcGrowth;
+    o.threads = options.threads;
+    o.jit = options.jit;
+    impl = make_unique<Impl>(o);
+}
+
+Interpreter::~Interpreter() = default;
+
+Datum Interpreter::eval(std::string_view source) {
+    RuntimeScope bound(impl->runtime);
+    Reader reader(source);
+    Value result = Value::nil();
+    Root root(result);
+    while (!reader.done()) result = impl->runtime.session->eval(reader.read());
+    return toDatum(result);
+}
+
+void Interpreter::define(std::string_view name, Native fn) {
+    Runtime& runtime = impl->runtime;
+    RuntimeScope bound(runtime);
+    runtime.callbacks.push_back([fn = move(fn)](const Value* args, int argc) {
+        vector<Datum> in;
+        in.reserve(argc);
+        for (int i = 0; i < argc; i++) in.push_back(toDatum(args[i]));
+        return fromDatum(fn(in));
+    });
+    ParseScope permanent;
+    Value proc = makeProc(nullptr);
+    proc.as<ProcObj>()->callback = &runtime.callbacks.back();
+    runtime.session->globals.set(name, proc);
+}
+
+void Interpreter::define(std::string_view name, const Datum& value) {
+    RuntimeScope bound(impl->runtime);
+    Value v = fromDatum(value);
+    Root root(v);
+    impl->runtime.session->globals.set(name, v);
+}
+
+void Interpreter::saveImage(const std::string& path) {
+    RuntimeScope bound(impl->runtime);
+    ::saveImage(*impl->runtime.session, path);
+}
+
+void Interpreter::loadImage(const std::string& path) {
+    RuntimeScope bound(impl->runtime);
+    ::loadImage(*impl->runtime.session, path.c_str());
+}
+
+}  // namespace lisp
+
+#ifndef LISP_LIBRARY
+namespace {
+
 // REPL
-void repl() {
-    auto env = standardEnv();
+void repl(Session& session) {
     string line;
-    
+
     while (true) {
         cout << "lisp> ";
         if (!getline(cin, line)) break;
-        
+
         if (line.empty()) continue;
-        
+
         try {
-            auto exp = parse(line);
-            auto val = eval(exp, env);
-            cout << val->toString() << endl;
+            Reader reader(line);
+            while (!reader.done()) {
+                cout << toString(session.eval(reader.read())) << endl;
+            }
         } catch (const exception& e) {
             cout << "Error: " << e.what() << endl;
         }
     }
-    
+
     cout << "\nBye!" << endl;
 }
 
-int main() {
-    repl();
-    return 0;
+// Batch mode
+//
+// Evaluates every top-level form in a file, however many lines it spans,
+// and prints each result. Each result is written and flushed as soon as its
+// form finishes, so nothing printed before an error or a crash is lost;
+// with `timing` each form's line, wall time and leading source text go to
+// stderr.
+bool runFile(const char* path, Session& session, bool timing) {
+    SourceFile file(path);
+    string_view src = file.text();
+    Reader reader(src);
+    size_t line = 1, counted = 0;
+    bool ok = true;
+
+    while (true) {
+        if (reader.done()) break;
+        size_t start = reader.offset();
+        line += count(src.begin() + counted, src.begin() + start, '\n');
+        counted = start;
+
+        try {
+            auto t0 = chrono::steady_clock::now();
+            Value val = session.eval(reader.read());
+            auto t1 = chrono::steady_clock::now();
+            string out = toString(val) + '\n';
+            fwrite(out.data(), 1, out.size(), stdout);
+            fflush(stdout);
+            if (timing) {
+                string_view form = src.substr(start, reader.offset() - start);
+                form = form.substr(0, min(form.find('\n'), size_t(60)));
+                fprintf(stderr, "%s:%zu: %10.3f ms  %.*s\n", path, line,
+                        chrono::duration<double, milli>(t1 - t0).count(),
+                        (int)form.size(), form.data());
+            }
+        } catch (const exception& e) {
+            fprintf(stderr, "%s:%zu: error: %s\n", path, line, e.what());
+            ok = false;
+            break;
+        }
+    }
+
+    return ok;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    RuntimeOptions options;
+    bool stats = false;
+    bool timing = false;
+    string profile;
+    const char* image = nullptr;
+    const char* script = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--engine=tree") {
+            options.engine = Engine::Tree;
+        } else if (arg == "--engine=bytecode") {
+            options.engine = Engine::Bytecode;
+        } else if (arg == "--alloc=malloc") {
+            options.alloc = AllocStrategy::Malloc;
+        } else if (arg == "--alloc=pool") {
+            options.alloc = AllocStrategy::Pooled;
+        } else if (arg == "--stats") {
+            stats = true;
+        } else if (arg.rfind("--threads=", 0) == 0 && atoi(arg.c_str() + 10) > 0) {
+            options.threads = atoi(arg.c_str() + 10);
+        } else if (arg == "--time") {
+            timing = true;
+        } else if (arg == "--jit=off") {
+            options.jit = false;
+        } else if (arg.rfind("--profile=", 0) == 0 && arg.size() > 10) {
+            profile = arg.substr(10);
+        } else if (arg.rfind("--image=", 0) == 0 && arg.size() > 8) {
+            image = argv[i] + 8;
+        } else if (arg == "--image" && i + 1 < argc) {
+            image = argv[++i];
+        } else if (arg[0] != '-' && !script) {
+            script = argv[i];
+        } else if (arg.rfind("--gc-growth=", 0) == 0 && atof(arg.c_str() + 12) > 1) {
+            options.gcGrowth = atof(arg.c_str() + 12);
+        } else {
+            cerr << "usage: " << argv[0]
+                 << " [--engine=tree|bytecode] [--alloc=pool|malloc] [--gc-growth=factor] [--threads=n] [--stats] [--time] [--profile=out.folded] [--jit=off] [--image=file] [file.scm]"
+                 << endl;
+            return 1;
+        }
+    }
+
+    if (!profile.empty()) profiler.start(profile);
+    Runtime runtime(options);
+    RuntimeScope bound(runtime);
+    int status = 0;
+    try {
+        if (image) loadImage(*runtime.session, image);
+        if (script) status = runFile(script, *runtime.session, timing) ? 0 : 1;
+        else repl(*runtime.session);
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        status = 1;
+    }
+    if (stats) {
+        runtime.memory.report(cerr);
+        runtime.collector.report(cerr);
+        runtime.memoStats.report(cerr);
+    }
+    return status;
 }
 
+#endif
@@ -0,0 +1,89 @@
+// Embedding API for the C++ Lisp interpreter
+//
+// Compile lisp.cpp with -DLISP_LIBRARY to leave out main() and link it
+// into the host program:
+//
+//     g++ -std=c++17 -O2 -DLISP_LIBRARY -c lisp.cpp
+//     g++ -std=c++17 -O2 host.cpp lisp.o -lpthread
+//
+// Every Interpreter owns its heap, collector, symbols, globals, JIT and
+// thread pool, so any number can run at once on different threads. One
+// interpreter must only be used by one thread at a time. The sampling
+// profiler is the exception: it is one process-wide SIGPROF timer, so it
+// is only available to the command-line interpreter (--profile) and this
+// API has no way to start it.
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace lisp {
+
+// A Lisp value copied out of (or into) an interpreter. Procedures, vectors,
+// hash tables and improper lists come out as Other, holding their printed
+// form, and cannot be passed back in.
+struct Datum {
+    enum Kind { Nil, Integer, Real, Symbol, List, Other };
+
+    Kind kind = Nil;
+    int64_t integer = 0;       // Integer, unless text holds the digits of a larger one
+    double real = 0;           // Real
+    std::string text;          // Symbol: the name; Other: the printed form
+    std::vector<Datum> items;  // List
+
+    Datum() = default;
+    Datum(int64_t n) : kind(Integer), integer(n) {}
+    Datum(int n) : Datum(int64_t(n)) {}
+    Datum(double x) : kind(Real), real(x) {}
+    static Datum symbol(std::string name);
+    static Datum list(std::vector<Datum> items);
+
+    std::string str() const;  // as the REPL would print it
+};
+
+struct Options {
+    bool bytecode = false;  // compile to bytecode instead of walking the tree
+    bool jit = true;        // compile hot integer lambdas to native code
+    unsigned threads = 0;   // workers for future and pmap; 0 for one per core
+    double gcGrowth = 2.0;  // heap growth past the live set between collections
+};
+
+class Interpreter {
+public:
+    using Native = std::function<Datum(const std::vector<Datum>& args)>;
+
+    Interpreter();
+    explicit Interpreter(const Options& options);
+    ~Interpreter();
+
+    Interpreter(const Interpreter&) = delete;
+    Interpreter& operator=(const Interpreter&) = delete;
+
+    // Evaluates every form in source and returns the value of the last.
+    // Errors throw std::runtime_error; definitions made before the failing
+    // form are kept. Code stays loaded for the interpreter's lifetime.
+    Datum eval(std::string_view source);
+
+    // Binds a global to a C++ function or to a value. A native function
+    // may throw std::exception to raise a Lisp error; when called from
+    // future or pmap it runs on a pool thread, where it cannot return a
+    // symbol the interpreter has not seen before.
+    void define(std::string_view name, Native fn);
+    void define(std::string_view name, const Datum& value);
+
+    // save-image and --image. Natives are saved by name, so an image must
+    // be loaded by an interpreter that has defined the same ones, in the
+    // same order, first.
+    void saveImage(const std::string& path);
+    void loadImage(const std::string& path);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+}  // namespace lisp
@@ -0,0 +1,104 @@
+#!/bin/bash
+# Regression tests for the C++ interpreter: ./tests.sh
+# Each case runs a program in batch mode under a timeout and checks that its
+# combined output contains the expected text.
+
+cd "$(dirname "$0")"
+g++ -std=c++17 -O2 lisp.cpp -o lisp_test -lpthread || exit 1
+work=$(mktemp -d)
+trap 'rm -rf "$work" lisp_test' EXIT
+failures=0
+
+# check <name> <expected text> <program> [interpreter flags...]
+check() {
+    local name=$1 expected=$2 program=$3
+    shift 3
+    printf '%s\n' "$program" > "$work/test.scm"
+    local output
+    output=$(cd "$work" && timeout 10 "$OLDPWD/lisp_test" "$@" test.scm 2>&1)
+    if [[ $? -eq 124 ]]; then
+        echo "FAIL $name: timed out"
+        failures=$((failures + 1))
+    elif [[ "$output" != *"$expected"* ]]; then
+        echo "FAIL $name: expected '$expected', got: $output"
+        failures=$((failures + 1))
+    else
+        echo "ok   $name"
+    fi
+}
+
+# check_rss <name> <max peak RSS in KB> <program> [interpreter flags...]
+check_rss() {
+    local name=$1 limit=$2 program=$3
+    shift 3
+    printf '%s\n' "$program" > "$work/test.scm"
+    local rss
+    rss=$(cd "$work" && timeout 10 "$OLDPWD/lisp_test" --stats "$@" test.scm 2>&1 | sed -n 's/^peak RSS: \([0-9]*\) KB$/\1/p')
+    if [[ -z "$rss" ]]; then
+        echo "FAIL $name: no peak RSS reported"
+        failures=$((failures + 1))
+    elif (( rss > limit )); then
+        echo "FAIL $name: peak RSS $rss KB, expected at most $limit KB"
+        failures=$((failures + 1))
+    else
+        echo "ok   $name"
+    fi
+}
+
+for threads in 1 2; do
+    check "save-image in a future, $threads threads" "cannot save from inside a future" \
+        '(touch (future (lambda () (save-image "x.img"))))' --threads=$threads
+    check "save-image in pmap, $threads threads" "cannot save from inside a future" \
+        '(pmap (lambda (x) (save-image "x.img")) (list 1))' --threads=$threads
+done
+# Tasks may only change the vectors and hash tables they made themselves;
+# the main thread waits for running tasks before changing one
+for threads in 1 2; do
+    check "hash-set! on a shared table in pmap, $threads threads" "cannot change a hash table shared" \
+        '(define h (make-hash-table))
+(pmap (lambda (x) (hash-set! h x x)) (list 1 2 3 4))' --threads=$threads
+    check "vector-set! on a shared vector in a future, $threads threads" "cannot change a vector shared" \
+        '(define v (make-vector 4 0))
+(touch (future (lambda () (vector-set! v 0 1))))' --threads=$threads
+    check "hash-set! on a task's own table, $threads threads" "(2 2)" \
+        '(define put (lambda (h) (car (list h (hash-set! h 1 1) (hash-set! h 2 2)))))
+(pmap (lambda (x) (hash-count (put (make-hash-table)))) (list 1 2))' --threads=$threads
+done
+check "vector-set! waits for the futures reading it" "(0 #(7 0 0))" \
+    '(define v (make-vector 3 0))
+(define slow (lambda (n) (if (= n 0) (vector-ref v 0) (slow (- n 1)))))
+(define f (future (lambda () (slow 100000))))
+(vector-set! v 0 7)
+(list (touch f) v)' --threads=2
+check "save-image at top level" '"x.img"' '(save-image "x.img")'
+
+# Damaged images must be refused, not read out of bounds: one cut short, and
+# one whose first record (a global's name) claims a 2 GB string
+head -c 200 "$work/x.img" > "$work/short.img"
+cp "$work/x.img" "$work/long-name.img"
+printf '\xff\xff\xff\x7f\0\0\0\0' | dd of="$work/long-name.img" bs=1 seek=32 conv=notrunc status=none
+check "truncated image" "corrupt image" '(+ 1 2)' --image=short.img
+check "string longer than its record" "corrupt image" '(+ 1 2)' --image=long-name.img
+
+# Blocks too large for the pool's size classes must be freed, not leaked:
+# each pass allocates 8 KB, 400 MB in all
+churn='(define churn (lambda (n v) (if (= n 0) (vector-length v) (churn (- n 1) (make-vector 1000 n)))))'
+check_rss "large vectors are reclaimed" 65536 "$churn (churn 50000 (vector))"
+
+# A crash must not lose the results printed before it
+for engine in tree bytecode; do
+    check "output before too deep a recursion ($engine)" $'3\n<lambda>\n10\n'"test.scm:4: error: recursion too deep" \
+        '(+ 1 2)
+(define g (lambda (n) (if (= n 0) 0 (+ 1 (g (- n 1))))))
+(g 10)
+(g 100000000)' --engine=$engine
+    check "too deep a recursion through a memoized function ($engine)" "recursion too deep" \
+        '(define m (memoize (lambda (n) (if (= n 0) 0 (+ 1 (m (- n 1)))))))
+(m 100000000)' --engine=$engine
+    check "too deep a recursion inside a future ($engine)" "recursion too deep" \
+        '(define g (lambda (n) (if (= n 0) 0 (+ 1 (g (- n 1))))))
+(touch (future (lambda () (g 100000000))))' --engine=$engine --threads=2
+done
+
+echo "$failures failed"
+[[ $failures -eq 0 ]]